@@ -23,6 +23,8 @@
 #include <math.h>
 #include <time.h>
 
+#include <map>
+
 #include "gibbs-base.h"
 #include "sample-mm.h"
 
@@ -232,28 +234,43 @@ void MM::resample_posterior_c_for(unsigned d) {
 
     CHECK_LE(_phi[_c[d]].ndsum, _lD);
 
+    // Collapse the part of the document accounted for by the clustering
+    map<unsigned, unsigned> slice;
+    unsigned slice_total = 0;
+    for (int n = 0; n < _D[d].size(); n++) {
+        if (_z[d][n] == 0) {
+            slice[_D[d][n]] += 1;
+            slice_total += 1;
+        }
+    }
+    feature_counts slice_counts(slice.begin(), slice.end());
+
+    // Now account for the likelihood of the data (marginal posterior of
+    // DP-Mult). This integrates over the orderings of the words, unlike
+    // document_slice_log_likelihood. The topic model part of that is left
+    // out, since with d removed it is the same for every cluster.
+    _scorer.load(_phi);
+    double new_cluster_score = _scorer.score(slice_counts, slice_total,
+            _beta, _beta_sum, &_scores);
+
     vector<pair<unsigned,double> > lp_c_d;
 
     unsigned test_ndsum = 0;
-    for (google::dense_hash_map<unsigned,CRP>::iterator itr = _phi.begin();
-            itr != _phi.end();
-            itr++) {
-        unsigned l = itr->first;
+    for (int k = 0; k < _scorer.size(); k++) {
+        unsigned l = _scorer.id(k);
 
         double log_lik = 0;
         
         // First add in the prior over the clusters
         if (FLAGS_mm_prior == kDirichletMixture) {
-            log_lik += log(_xi[l] + _phi[l].ndsum) - log(_xi_sum + _lD);
+            log_lik += log(_xi[l] + _scorer.ndsum(k)) - log(_xi_sum + _lD);
         } else if (FLAGS_mm_prior == kDirichletProcess) {
-            log_lik += log(_phi[l].ndsum) - log(_lD - 1 + FLAGS_mm_xi);
-            test_ndsum += _phi[l].ndsum;
+            log_lik += log(_scorer.ndsum(k)) - log(_lD - 1 + FLAGS_mm_xi);
+            test_ndsum += _scorer.ndsum(k);
         }
 
-        // Now account for the likelihood of the data (marginal posterior of
-        // DP-Mult)
         CHECK((l < FLAGS_K) || FLAGS_mm_prior == kDirichletProcess) << "A";
-        log_lik += document_slice_log_likelihood(d, l);
+        log_lik += _scores[k];
 
         lp_c_d.push_back(pair<unsigned,double>(l, log_lik));
     }
@@ -261,14 +278,7 @@ void MM::resample_posterior_c_for(unsigned d) {
 
     // Add an additional new component if DP
     if (FLAGS_mm_prior == kDirichletProcess) {
-        double log_lik = log(FLAGS_mm_xi) - log(_lD - 1 + FLAGS_mm_xi);
-        for (int n = 0; n < _D[d].size(); n++) {
-            if (_z[d][n] == 0) {
-                unsigned w = _D[d][n];
-                log_lik += log(_beta[w]) - log(_beta_sum);
-            }
-        }
-
+        double log_lik = log(FLAGS_mm_xi) - log(_lD - 1 + FLAGS_mm_xi) + new_cluster_score;
         lp_c_d.push_back(pair<unsigned,double>(_current_component, log_lik));
     }
 
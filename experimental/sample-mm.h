@@ -22,6 +22,7 @@
 #include <vector>
 
 #include "gibbs-base.h"
+#include "mixture-scorer.h"
 
 // Number of clusters
 DECLARE_int32(K);
@@ -79,6 +80,10 @@ class MM : public GibbsSampler {
         cluster_map _c; // Map data point -> cluster
         clustering _phi;  // Map [w][z] -> CRP
 
+        // Scores documents against the clusters in _phi
+        MixtureScorer _scorer;
+        vector<double> _scores;
+
         topic_map _z; // Map word to noise or data
         clustering _phi_noise;  // Distribution for the noise
 
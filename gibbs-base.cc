@@ -21,6 +21,9 @@
 
 #include <string>
 #include <fstream>
+#include <algorithm>
+
+#include <pthread.h>
 
 #include "dSFMT-src-2.0/dSFMT.h"
 
@@ -96,9 +99,26 @@ DEFINE_bool(output_last,
             false,
             "Output the last sample");
 
+// Number of worker threads for the samplers that support parallel sweeps
+DEFINE_int32(threads,
+             1,
+             "number of sampling threads (samplers without parallel sweeps ignore this)");
+
 // The Mersenne Twister
 dsfmt_t dsfmt;
 
+// Generator state owned by a single worker thread
+struct ThreadRandom {
+#ifdef USE_MT_RANDOM
+    dsfmt_t dsfmt;
+#else
+    unsigned state;
+#endif
+};
+
+// The generator installed for the calling thread, if any
+static __thread ThreadRandom* thread_random = NULL;
+
 void safe_remove_crp(vector<CRP*>* domain, const CRP* target) {
     vector<CRP*>::iterator p = find(domain->begin(), domain->end(), target);
     // must have existed
@@ -106,6 +126,21 @@ void safe_remove_crp(vector<CRP*>* domain, const CRP* target) {
     domain->erase(p);
 }
 
+void build_word_histogram(const Document& doc, WordHistogram* h) {
+    map<unsigned, unsigned> counts;
+    for (int n = 0; n < doc.size(); n++) {
+        counts[doc[n]] += 1;
+    }
+
+    h->words.clear();
+    h->counts.clear();
+    for (map<unsigned, unsigned>::const_iterator c_itr = counts.begin(); c_itr != counts.end(); c_itr++) {
+        h->words.push_back(c_itr->first);
+        h->counts.push_back(c_itr->second);
+    }
+    h->total = doc.size();
+}
+
 CRP::~CRP() {
     // TODO: want this check for the learned versions...
     // CHECK_LE(m, 1);  // don't delete without removing docs
@@ -330,24 +365,33 @@ bool word_score_comp(const word_score& left, const word_score& right) {
     return left.second > right.second;
 }
 
+// Orders (w, count) pairs by decreasing count
+static bool word_count_comp(const pair<unsigned, unsigned>& left,
+        const pair<unsigned, unsigned>& right) {
+    return left.second > right.second;
+}
+
 string GibbsSampler::show_chopped_sorted_nw(const WordToCountMap& nw) {
-    vector<word_score> sorted;
+    vector<pair<unsigned, unsigned> > sorted;
     for (WordToCountMap::const_iterator nw_itr = nw.begin();
             nw_itr != nw.end();
             nw_itr++) {
         unsigned w = nw_itr->first;
         unsigned c = nw_itr->second;
         if (c > 0) {
-            sorted.push_back(make_pair(_word_id_to_name[w], c));
+            sorted.push_back(make_pair(w, c));
         }
     }
 
-    sort(sorted.begin(), sorted.end(), word_score_comp);
+    // Only the top few get printed, so there's no need to sort the rest or
+    // to look up their names
+    unsigned top = min((int)sorted.size(), 10);
+    partial_sort(sorted.begin(), sorted.begin() + top, sorted.end(), word_count_comp);
 
     // Finally print out the summary
     string buffer = "";
-    for (int k = 0; k < min((int)sorted.size(), 10); k++) {
-        buffer += StringPrintf("%s %d ", sorted[k].first.c_str(), sorted[k].second);
+    for (int k = 0; k < top; k++) {
+        buffer += StringPrintf("%s %d ", _word_id_to_name[sorted[k].first].c_str(), sorted[k].second);
     }
 
     return buffer;
@@ -549,13 +593,86 @@ void normalizeLog(vector<pair<unsigned,double> >*x) {
 
 double sample_uniform() {
 #ifdef USE_MT_RANDOM
+    if (thread_random) {
+        return dsfmt_genrand_close_open(&thread_random->dsfmt);
+    }
     return dsfmt_genrand_close_open(&dsfmt);
 #else
+    if (thread_random) {
+        return rand_r(&thread_random->state) / (double)RAND_MAX;
+    }
     return random() / (double)RAND_MAX;
 #endif
 
 }
 
+ThreadRandom* new_thread_random(unsigned seed) {
+    ThreadRandom* r = new ThreadRandom;
+#ifdef USE_MT_RANDOM
+    dsfmt_init_gen_rand(&r->dsfmt, seed);
+#else
+    r->state = seed;
+#endif
+    return r;
+}
+
+void delete_thread_random(ThreadRandom* r) {
+    delete r;
+}
+
+void use_thread_random(ThreadRandom* r) {
+    thread_random = r;
+}
+
+// Shared state for the workers in run_parallel_tasks
+struct ParallelTaskQueue {
+    parallel_task task;
+    void* context;
+    const vector<ThreadRandom*>* randoms;
+    unsigned count;
+    unsigned next;
+    pthread_mutex_t lock;
+};
+
+static void* parallel_task_worker(void* arg) {
+    ParallelTaskQueue* q = (ParallelTaskQueue*)arg;
+    while (true) {
+        pthread_mutex_lock(&q->lock);
+        unsigned i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (i >= q->count) {
+            break;
+        }
+        use_thread_random(q->randoms->at(i));
+        q->task(q->context, i);
+    }
+    use_thread_random(NULL);
+    return NULL;
+}
+
+void run_parallel_tasks(unsigned count, parallel_task task, void* context,
+        const vector<ThreadRandom*>& randoms) {
+    CHECK_EQ(randoms.size(), count);
+    unsigned threads = min<unsigned>(max(FLAGS_threads, 1), count);
+
+    ParallelTaskQueue q;
+    q.task = task;
+    q.context = context;
+    q.randoms = &randoms;
+    q.count = count;
+    q.next = 0;
+    pthread_mutex_init(&q.lock, NULL);
+
+    vector<pthread_t> workers(threads);
+    for (int t = 0; t < threads; t++) {
+        CHECK_EQ(pthread_create(&workers[t], NULL, parallel_task_worker, &q), 0);
+    }
+    for (int t = 0; t < threads; t++) {
+        CHECK_EQ(pthread_join(workers[t], NULL), 0);
+    }
+    pthread_mutex_destroy(&q.lock);
+}
+
 // Given a multinomial distribution of the form {label:prob}, return a label
 // with that probability.
 inline int sample_normalized_multinomial(vector<double>*d) {
@@ -641,6 +758,30 @@ unsigned sample_unnormalized_log_multinomial(vector<pair<unsigned,double> >*d) {
     return -1;
 }
 
+// Same as above, but over a plain array so that callers with a fixed number of
+// outcomes can keep their scores on the stack.
+unsigned sample_unnormalized_log_multinomial(const double* d, unsigned size) {
+    double cut = sample_uniform();
+    CHECK_LE(cut, 1.0);
+    CHECK_GE(cut, 0.0);
+
+    unsigned int i;
+    long double s = 0;
+    for (i = 0; i < size; i++) {
+        s = addLog(s, d[i]);
+    }
+    for (i = 0; i < size; i++) {
+        cut -= exp(d[i] - s);
+
+        if (cut < 0) {
+            return i;
+        }
+    }
+
+    CHECK(false) << "improperly normalized distribution " << cut;
+    return 0;
+}
+
 sampler_entry NEW_sample_unnormalized_log_multinomial(vector<sampler_entry>*d) {
     double cut = sample_uniform();
     CHECK_LE(cut, 1.0);
@@ -682,8 +823,8 @@ unsigned sample_integer(unsigned range) {
 double sample_gaussian() {
     double x1, x2, w, y1;
 
-    static bool returned = false;
-    static double y2 = 0.0;
+    static __thread bool returned = false;
+    static __thread double y2 = 0.0;
 
     if (returned) {
         returned = false;
@@ -113,6 +113,9 @@ DECLARE_bool(output_best);
 // Should the last sample get output?
 DECLARE_bool(output_last);
 
+// Number of worker threads for the samplers that support parallel sweeps
+DECLARE_int32(threads);
+
 class CRP;
 
 typedef google::sparse_hash_map<unsigned, unsigned> WordToCountMap;
@@ -123,6 +126,14 @@ typedef google::dense_hash_map<unsigned, WordToCountMap> DocWordToCount;
 
 typedef vector<unsigned> Document;
 
+// Distinct words of a document (in increasing order) along with how often each
+// occurs
+struct WordHistogram {
+    vector<unsigned> words;
+    vector<unsigned> counts;
+    unsigned total;  // number of tokens
+};
+
 typedef google::dense_hash_map<unsigned, Document> DocumentMap;
 typedef google::dense_hash_map<unsigned, string> DocIDToTitle;
 typedef google::dense_hash_map<string, unsigned> TitleToDocID;
@@ -157,19 +168,19 @@ class sampler_entry {
 // children, e.g. the tables in the restaurant that it points to.
 class CRP {
     public:
-        CRP() : nwsum(0), label(""), ndsum(0) { 
+        CRP() : nwsum(0), label(""), ndsum(0), nonzero_ndsum(0) { 
             nw.set_deleted_key(kDeletedUnsignedKey); 
             nd.set_deleted_key(kDeletedUnsignedKey); 
         }
         CRP(unsigned l, unsigned customers)
-            : level(l), nwsum(0), lp(0), label(""), ndsum(customers) { 
+            : level(l), nwsum(0), lp(0), label(""), ndsum(customers), nonzero_ndsum(0) { 
                 nw.set_deleted_key(kDeletedUnsignedKey); 
                 nd.set_deleted_key(kDeletedUnsignedKey); 
                 // nw.set_empty_key(kEmptyUnsignedKey); 
                 // nd.set_empty_key(kEmptyUnsignedKey); 
             }
         CRP(unsigned l, unsigned customers, CRP* p)
-            : level(l), nwsum(0), lp(0), label(""), ndsum(customers) {
+            : level(l), nwsum(0), lp(0), label(""), ndsum(customers), nonzero_ndsum(0) {
                 prev.push_back(p); 
                 nw.set_deleted_key(kDeletedUnsignedKey); 
                 nd.set_deleted_key(kDeletedUnsignedKey); 
@@ -246,6 +257,11 @@ class CRP {
         unsigned nwsum;  // number of words in this node
         unsigned ndsum;  // number of docs in this node (same as m)
 
+        // number of docs in this node that have at least one word in it; the
+        // mixture models assign every doc a cluster in every view, even views
+        // the doc has no words in
+        unsigned nonzero_ndsum;
+
         vector<CRP*> prev;  // the parents of this node in the DAG
 
         vector<CRP*> tables;  // the tables in the next restaurant
@@ -376,6 +392,9 @@ void init_random();
 // Safely remove an element from a list
 void safe_remove_crp(vector<CRP*>* v, const CRP*);
 
+// Fills h with the word histogram of doc
+void build_word_histogram(const Document& doc, WordHistogram* h);
+
 // These are adapted from Hal Daume's HBC:
 
 // Logarithm of the gamma function.
@@ -394,6 +413,7 @@ inline int sample_normalized_multinomial(vector<double>*d);
 inline int sample_normalized_multinomial(vector<pair<unsigned,double> >*d);
 unsigned sample_unnormalized_log_multinomial(vector<double>*d);
 unsigned sample_unnormalized_log_multinomial(vector<pair<unsigned,double> >*d);
+unsigned sample_unnormalized_log_multinomial(const double* d, unsigned size);
 sampler_entry NEW_sample_unnormalized_log_multinomial(vector<sampler_entry>*d);
 int SAFE_sample_unnormalized_log_multinomial(vector<double>*d);
 int SAFE_sample_unnormalized_log_multinomial(vector<pair<unsigned,double> >*d);
@@ -402,6 +422,22 @@ unsigned sample_integer(unsigned range);
 double sample_gaussian();
 double sample_uniform();
 
+// Per-thread random number generators. Worker threads install their own
+// generator with use_thread_random so that the sample_* functions above don't
+// race on the global one; passing NULL goes back to the global generator.
+struct ThreadRandom;
+ThreadRandom* new_thread_random(unsigned seed);
+void delete_thread_random(ThreadRandom* r);
+void use_thread_random(ThreadRandom* r);
+
+// Runs task(context, i) for every i in [0, count) over up to FLAGS_threads
+// worker threads, returning once all of them are done. Tasks are handed out
+// one at a time, and randoms[i] is installed as the generator while task i
+// runs, so the draws each task sees don't depend on the number of threads.
+typedef void (*parallel_task)(void* context, unsigned i);
+void run_parallel_tasks(unsigned count, parallel_task task, void* context,
+        const vector<ThreadRandom*>& randoms);
+
 string get_base_name(const string& s);
 // filtering_ostream get_bz2_ostream(const string& filename);
 bool is_bz2_file(const string& s);
@@ -0,0 +1,89 @@
+/*
+   Copyright 2010 Joseph Reisinger
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <math.h>
+
+#include "gibbs-base.h"
+#include "mixture-scorer.h"
+
+// Counts up to this size get their log-gamma ratio as a product
+const unsigned kMaxProductCount = 8;
+
+double log_gamma_ratio(double x, unsigned c) {
+    if (c == 0) {
+        return 0;
+    } else if (c == 1) {
+        return log(x);
+    } else if (c <= kMaxProductCount) {
+        double product = x;
+        for (unsigned i = 1; i < c; i++) {
+            product *= x + i;
+        }
+        return log(product);
+    }
+    return gammaln(x + c) - gammaln(x);
+}
+
+void MixtureScorer::load(const clustering& cm) {
+    _ids.clear();
+    _nwsum.clear();
+    _ndsum.clear();
+    _nw.clear();
+    for (clustering::const_iterator itr = cm.begin(); itr != cm.end(); itr++) {
+        _ids.push_back(itr->first);
+        _nwsum.push_back(itr->second.nwsum);
+        _ndsum.push_back(itr->second.ndsum);
+        _nw.push_back(&itr->second.nw);
+    }
+}
+
+double MixtureScorer::score(const feature_counts& doc, unsigned total,
+        const vector<double>& eta, double eta_sum, vector<double>* scores) {
+    unsigned K = _ids.size();
+
+    // Gather the document's counts cluster by cluster, so each cluster's
+    // hash map is only walked once
+    _slab.assign(doc.size() * K, 0);
+    for (int k = 0; k < K; k++) {
+        const WordToCountMap& nw = *_nw[k];
+        for (int i = 0; i < doc.size(); i++) {
+            WordToCountMap::const_iterator nw_itr = nw.find(doc[i].first);
+            if (nw_itr != nw.end()) {
+                _slab[i * K + k] = nw_itr->second;
+            }
+        }
+    }
+
+    // Normalizer for the multinomial-dirichlet likelihood
+    scores->resize(K);
+    for (int k = 0; k < K; k++) {
+        (*scores)[k] = -log_gamma_ratio(eta_sum + _nwsum[k], total);
+    }
+    double empty_score = -log_gamma_ratio(eta_sum, total);
+
+    // The data; clusters that don't have the word all share the same term
+    for (int i = 0; i < doc.size(); i++) {
+        unsigned w = doc[i].first;
+        unsigned count = doc[i].second;
+        double unseen = log_gamma_ratio(eta[w], count);
+        for (int k = 0; k < K; k++) {
+            unsigned nw = _slab[i * K + k];
+            (*scores)[k] += (nw == 0) ? unseen : log_gamma_ratio(eta[w] + nw, count);
+        }
+        empty_score += unseen;
+    }
+
+    return empty_score;
+}
@@ -0,0 +1,72 @@
+/*
+   Copyright 2010 Joseph Reisinger
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Scores a single (collapsed) document against every cluster of a mixture
+// model under the Dirichlet-multinomial likelihood. This is the inner loop of
+// all the mixture model samplers (CrossCatMM, SoftCrossCatMM, MM).
+
+#ifndef MIXTURE_SCORER_H_
+#define MIXTURE_SCORER_H_
+
+#include <vector>
+
+#include "gibbs-base.h"
+
+// A document as a list of (feature, count) pairs
+typedef vector<pair<unsigned, unsigned> > feature_counts;
+
+// log Gamma(x + c) - log Gamma(x), i.e. the log of the rising factorial
+// x (x+1) ... (x+c-1). Small counts are done as a product of logs instead of
+// two gammalns.
+double log_gamma_ratio(double x, unsigned c);
+
+// Holds a snapshot of a clustering laid out as arrays (cluster ids, nwsum,
+// ndsum), and scores documents against all of the clusters at once: the
+// document's counts in each cluster are gathered into a word-major slab, and
+// then each word is scored against every cluster in one pass, sharing the
+// log-gamma term between all the clusters the word doesn't occur in.
+//
+// The snapshot has to be reloaded whenever the clustering changes.
+class MixtureScorer {
+    public:
+        MixtureScorer() { }
+
+        // Take a snapshot of the clusters in cm, in cm's iteration order
+        void load(const clustering& cm);
+
+        unsigned size() const { return _ids.size(); }
+        unsigned id(unsigned k) const { return _ids[k]; }
+        unsigned nwsum(unsigned k) const { return _nwsum[k]; }
+        unsigned ndsum(unsigned k) const { return _ndsum[k]; }
+
+        // Fills scores[k] with the log likelihood of doc (which has total
+        // tokens) under the k-th loaded cluster given the smoother eta, and
+        // returns its log likelihood under a new, empty cluster.
+        double score(const feature_counts& doc, unsigned total,
+                const vector<double>& eta, double eta_sum,
+                vector<double>* scores);
+
+    private:
+        vector<unsigned> _ids;
+        vector<unsigned> _nwsum;
+        vector<unsigned> _ndsum;
+        vector<const WordToCountMap*> _nw;
+
+        // [i * size() + k] -> count of the document's i-th feature in the
+        // k-th cluster
+        vector<unsigned> _slab;
+};
+
+#endif  // MIXTURE_SCORER_H_
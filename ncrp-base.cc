@@ -130,14 +130,13 @@ NCRPBase::NCRPBase()
     _alpha_sum = _L*FLAGS_ncrp_alpha;
 
     _ncrp_root = new CRP(0, 0);
+    _stats.add_node(0);
 
     // Allocate the first chain of L guys
     CRP* current = _ncrp_root;
     for (unsigned l = 1; l < _L; l++) {
-        current->tables.push_back(new CRP(l, 0, current));
-        current = current->tables[0];
+        current = graft_node(l, current);
     }
-    _unique_nodes = _L;
 
     // For each document, allocate a topic path for it there are several ways to
     // do this, e.g. a single linear chain, incremental conditional sampling and
@@ -146,6 +145,8 @@ NCRPBase::NCRPBase()
     _z.set_empty_key(kEmptyUnsignedKey); 
     _c.set_deleted_key(kDeletedUnsignedKey); 
     _z.set_deleted_key(kDeletedUnsignedKey); 
+
+    _path_kernel = select_path_probability_kernel();
 }
 
 void NCRPBase::batch_allocation() {
@@ -170,6 +171,8 @@ void NCRPBase::allocate_document(unsigned d) {
         CHECK(_c[d][l]);
         _c[d][l]->ndsum += 1;  // number of docuemnts in this CRP
     }
+    _stats.ndsum += _L;
+    _stats.nwsum += _D[d].size();
 
     // Incrementally reconstruct the tree (each time we add a document,
     // update its tree assignment based only on the previously added
@@ -208,7 +211,7 @@ void NCRPBase::allocate_document(unsigned d) {
     }
 
     if (d % 1000 == 0 && d > 0) {
-      LOG(INFO) << "Sorted " << d << " documents into " << _unique_nodes << " clusters.";
+      LOG(INFO) << "Sorted " << d << " documents into " << _stats.nodes << " clusters.";
     }
 }
 
@@ -227,10 +230,19 @@ void NCRPBase::deallocate_document() {
 
     VLOG(1) << "deallocating " << d;
 
+    unsigned ndsum_before = 0;
+    for (int l = 0; l < _c[d].size(); l++) {
+        ndsum_before += _c[d][l]->ndsum;
+    }
     for (int n = 0; n < _D[d].size(); n++) {
         unsigned w = _D[d][n];
         _c[d][_z[d][n]]->remove(w,d);
     }
+    for (int l = 0; l < _c[d].size(); l++) {
+        ndsum_before -= _c[d][l]->ndsum;
+    }
+    _stats.ndsum -= ndsum_before;
+    _stats.nwsum -= _D[d].size();
     _z.erase(d);
     _c.erase(d);
     _D.erase(d);
@@ -306,10 +318,45 @@ void NCRPBase::resample_posterior_c_for(unsigned d) {
     VLOG(1) << "done";
 }
 
+// Picks the path kernel instantiation for the current flag settings. These
+// don't change after startup, so this is only called from the constructor.
+NCRPBase::PathProbabilityKernel NCRPBase::select_path_probability_kernel() {
+    bool m_dependent_gamma = FLAGS_ncrp_m_dependent_gamma;
+    bool eta_depth_scale = FLAGS_ncrp_eta_depth_scale < 1.0;
+    bool prix_fixe = FLAGS_ncrp_prix_fixe;
+    bool max_branches = FLAGS_ncrp_max_branches != -1;
+
+    unsigned code = (m_dependent_gamma << 3) | (eta_depth_scale << 2)
+        | (prix_fixe << 1) | max_branches;
+
+#define PATH_KERNEL(a, b, c, d) \
+    &NCRPBase::calculate_path_probabilities_kernel<PathKernelPolicy<a, b, c, d> >
+    switch (code) {
+        case 0:  return PATH_KERNEL(false, false, false, false);
+        case 1:  return PATH_KERNEL(false, false, false, true);
+        case 2:  return PATH_KERNEL(false, false, true,  false);
+        case 3:  return PATH_KERNEL(false, false, true,  true);
+        case 4:  return PATH_KERNEL(false, true,  false, false);
+        case 5:  return PATH_KERNEL(false, true,  false, true);
+        case 6:  return PATH_KERNEL(false, true,  true,  false);
+        case 7:  return PATH_KERNEL(false, true,  true,  true);
+        case 8:  return PATH_KERNEL(true,  false, false, false);
+        case 9:  return PATH_KERNEL(true,  false, false, true);
+        case 10: return PATH_KERNEL(true,  false, true,  false);
+        case 11: return PATH_KERNEL(true,  false, true,  true);
+        case 12: return PATH_KERNEL(true,  true,  false, false);
+        case 13: return PATH_KERNEL(true,  true,  false, true);
+        case 14: return PATH_KERNEL(true,  true,  true,  false);
+        default: return PATH_KERNEL(true,  true,  true,  true);
+    }
+#undef PATH_KERNEL
+}
+
 // Starting from node root, calculate the probability of attaching document d
 // down any possible subtree (including new ones that might be added) to a
 // maximum depth of _c[d]'s required depth
-void NCRPBase::calculate_path_probabilities_for_subtree(
+template <class Policy>
+void NCRPBase::calculate_path_probabilities_kernel(
         CRP* root,
         unsigned d,
         unsigned max_depth,
@@ -317,11 +364,52 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
         LevelToCountMap&     nwsum_removed,
         vector<double>* lp_c_d,
         vector<CRP*>* c_d) {
+    VLOG(2) << "Calculate path probabilities";
+    unsigned chain_depth = _c[d].size();
+
+    // Rescale eta dependening on depth; the table grows with the tree for
+    // the GEM sampler
+    unsigned table_depth = max(max(max_depth, chain_depth), root->level+1);
+    if (Policy::eta_depth_scale) {
+        for (unsigned l = _eta_depth_scale.size(); l < table_depth; l++) {
+            _eta_depth_scale.push_back(pow(FLAGS_ncrp_eta_depth_scale, (double)l));
+        }
+    }
+
+    // The log-data-likelihood of hanging this document's words off of a brand
+    // new chain only depends on the level where the chain starts, not on the
+    // node it branches from, so compute it once per level here.
+    // _lp_new_chain[l] holds the contribution of levels l..chain_depth-1.
+    _lp_new_chain.assign(chain_depth+1, 0);
+    for (int l = chain_depth-1; l >= 0; l--) {
+        double l_eta_depth_scale = Policy::eta_depth_scale ? _eta_depth_scale[l] : 1.0;
+        double lp = gammaln(_eta_sum*l_eta_depth_scale) - gammaln(nwsum_removed[l] + _eta_sum*l_eta_depth_scale);
+
+        int total_removed = 0;
+
+        // This is actually computing over w \in V but when count=0 the etas
+        // cancel
+        for (WordToCountMap::iterator itr = nw_removed[l].begin(); itr != nw_removed[l].end(); itr++) {
+            // itr->first = word
+            // itr->second = count
+            lp += gammaln(itr->second + _eta[itr->first]*l_eta_depth_scale) - gammaln(_eta[itr->first]*l_eta_depth_scale);
+            total_removed += itr->second;
+        }
+        CHECK_EQ(total_removed, nwsum_removed[l]);
+
+        _lp_new_chain[l] = lp + _lp_new_chain[l+1];
+    }
+
+    // Prix-fixe trees are a single chain with all of the branching at the
+    // last level, so they get their own flat loop over the leaves
+    if (Policy::prix_fixe && calculate_prix_fixe_path_probabilities<Policy>(root,
+                d, max_depth, nw_removed, nwsum_removed, lp_c_d, c_d)) {
+        return;
+    }
+
     // Loop over every node in the tree using a level-by-level traversal,
     // ensuring that each time we visit a node, we have already calculated the
     // path probability up to its parent
-    VLOG(2) << "Calculate path probabilities";
-    _unique_nodes = 0;  // recalculate the tree size
     deque<CRP*> node_queue;
     node_queue.push_back(root);
     while (!node_queue.empty()) {
@@ -329,7 +417,6 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
         node_queue.pop_front();
 
         CHECK(current);
-        _unique_nodes += 1;
 
         // TODO:: this is only good for the infinite depth version, the
         // fixed depth version needs the check above
@@ -337,7 +424,7 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
         if (current->ndsum == 0) {
             CHECK(current != root) << "tried to delete the root!";
             // LOG(INFO) << "about to delete " << d << " " << current;
-            delete current;  // this will recurse through the children
+            collect_node(current);  // this will recurse through the children
             continue;
         }
 
@@ -347,7 +434,7 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
             CHECK_EQ(current->prev.size(), 1);
 
             // compute the probability of getting to this node
-            if (FLAGS_ncrp_m_dependent_gamma) {
+            if (Policy::m_dependent_gamma) {
                 current->lp = log(current->ndsum) - log((_gamma + 1) * current->prev[0]->ndsum - 1) + current->prev[0]->lp;
             } else {
                 current->lp = log(current->ndsum) - log(_gamma + current->prev[0]->ndsum - 1) + current->prev[0]->lp;
@@ -356,28 +443,9 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
             current->lp = 0;
         }
 
-        // Rescale eta dependening on depth
-        double eta_depth_scale = 1.0;
-        if (FLAGS_ncrp_eta_depth_scale < 1.0) {
-            eta_depth_scale = pow(FLAGS_ncrp_eta_depth_scale, (double)current->level);
-            // LOG(INFO) << "scaling eta at level " << current->level;
-        }
-
         // multiply in the data likelihood for this level
-        // Compute a single level's contribution to the log data likelihood
-        current->lp += gammaln(current->nwsum + _eta_sum*eta_depth_scale)
-            - gammaln(current->nwsum + nwsum_removed[current->level] + _eta_sum*eta_depth_scale);
-
-        // We don't care about the terms here where nw_removed is zero, since
-        // they cancel out.
-        for (WordToCountMap::iterator itr = nw_removed[current->level].begin(); itr != nw_removed[current->level].end(); itr++) {
-            unsigned w = itr->first;  // the word
-            unsigned count = itr->second;
-            current->lp += gammaln(current->nw[w] + count + _eta[w]*eta_depth_scale) - gammaln(current->nw[w] + _eta[w]*eta_depth_scale);
-        }
-
-        // Now the rest of the vocabulary is accounted for, since
-        // gammaln(0+0+eta) - gammaln(0+eta) = 0
+        current->lp += level_data_log_likelihood<Policy>(current,
+                nw_removed[current->level], nwsum_removed[current->level]);
 
         // Now start adding in the next level stuff
         // If prix-fixe is turned on, then we should only branch if we're at the
@@ -386,13 +454,13 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
         if (current->level < max_depth-1) {
             // i.e. internal to this topic chain (_c[d]), so might make a new
             // branch
-            if ((!FLAGS_ncrp_prix_fixe || current->level == max_depth-2) 
-                    && (FLAGS_ncrp_max_branches == -1 || current->tables.size() < FLAGS_ncrp_max_branches)) {
+            if ((!Policy::prix_fixe || current->level == max_depth-2)
+                    && (!Policy::max_branches || current->tables.size() < FLAGS_ncrp_max_branches)) {
                 // Add the probability of escaping from this node (new branch)
 
                 // Base log-probability of getting here plus taking the new table
                 double prob = 0;
-                if (FLAGS_ncrp_m_dependent_gamma) {
+                if (Policy::m_dependent_gamma) {
                     // NOTE before this was:
                     // prob = current->lp + log(_gamma * current->ndsum) - log(_gamma + current->ndsum - 1);
                     prob = current->lp + log(_gamma * current->ndsum) - log((_gamma+1) * current->ndsum - 1);
@@ -400,29 +468,10 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
                     prob = current->lp + log(_gamma) - log(_gamma + current->ndsum - 1);
                 }
 
-
                 // Add in the log-data-likelihood all the way down the new chain
                 // taking into account this document's current chain length
-                for (int l = current->level+1; l < _c[d].size(); l++) {
-                    // Rescale eta dependening on depth
-                    double l_eta_depth_scale = 1.0;
-                    if (FLAGS_ncrp_eta_depth_scale < 1.0) {
-                        l_eta_depth_scale = pow(FLAGS_ncrp_eta_depth_scale, (double)l);
-                        // LOG(INFO) << "scaling l_eta at level " << l;
-                    }
-                    prob += gammaln(_eta_sum*l_eta_depth_scale) - gammaln(nwsum_removed[l] + _eta_sum*l_eta_depth_scale);
-
-                    int total_removed = 0;
-
-                    // This is actually computing over w \in V but when count=0 the etas
-                    // cancel
-                    for (WordToCountMap::iterator itr = nw_removed[l].begin(); itr != nw_removed[l].end(); itr++) {
-                        // itr->first = word
-                        // itr->second = count
-                        prob += gammaln(itr->second + _eta[itr->first]*l_eta_depth_scale) - gammaln(_eta[itr->first]*l_eta_depth_scale);
-                        total_removed += itr->second;
-                    }
-                    CHECK_EQ(total_removed, nwsum_removed[l]);
+                if (current->level+1 < chain_depth) {
+                    prob += _lp_new_chain[current->level+1];
                 }
 
                 lp_c_d->push_back(prob);
@@ -440,6 +489,129 @@ void NCRPBase::calculate_path_probabilities_for_subtree(
     VLOG(2) << "done";
 }
 
+// Compute a single level's contribution to the log data likelihood of adding
+// the removed words back in at node
+template <class Policy>
+double NCRPBase::level_data_log_likelihood(CRP* node,
+        WordToCountMap& nw_removed_l,
+        unsigned nwsum_removed_l) {
+    double eta_depth_scale = Policy::eta_depth_scale ? _eta_depth_scale[node->level] : 1.0;
+
+    double lp = gammaln(node->nwsum + _eta_sum*eta_depth_scale)
+        - gammaln(node->nwsum + nwsum_removed_l + _eta_sum*eta_depth_scale);
+
+    // We don't care about the terms here where nw_removed is zero, since
+    // they cancel out.
+    for (WordToCountMap::iterator itr = nw_removed_l.begin(); itr != nw_removed_l.end(); itr++) {
+        unsigned w = itr->first;  // the word
+        unsigned count = itr->second;
+        lp += gammaln(node->nw[w] + count + _eta[w]*eta_depth_scale) - gammaln(node->nw[w] + _eta[w]*eta_depth_scale);
+    }
+
+    // Now the rest of the vocabulary is accounted for, since
+    // gammaln(0+0+eta) - gammaln(0+eta) = 0
+    return lp;
+}
+
+// Prix-fixe version of the path kernel. Every document shares the same L-1
+// chain, so its probability (CRP terms and data likelihood) is computed once
+// and only the leaf-level terms are evaluated per leaf. Produces the same
+// options in the same order as the BFS (new branch first, then the leaves).
+// Returns false if the tree below root doesn't have the prix-fixe shape, in
+// which case the caller falls back to the general traversal.
+template <class Policy>
+bool NCRPBase::calculate_prix_fixe_path_probabilities(
+        CRP* root,
+        unsigned d,
+        unsigned max_depth,
+        LevelWordToCountMap& nw_removed,
+        LevelToCountMap&     nwsum_removed,
+        vector<double>* lp_c_d,
+        vector<CRP*>* c_d) {
+    if (root != _ncrp_root || max_depth < 2) {
+        return false;
+    }
+
+    // Walk down the shared chain to the branching node
+    CRP* current = root;
+    while (current->level < max_depth-2) {
+        if (current->tables.size() != 1 || current->ndsum == 0) {
+            return false;
+        }
+        current = current->tables[0];
+    }
+    if (current->level != max_depth-2 || current->ndsum == 0) {
+        return false;
+    }
+    CRP* branch = current;
+
+    // The BFS decides on the new table before it reaches (and drops) the empty
+    // leaves, so they still count against the branching limit
+    bool new_table_allowed = !Policy::max_branches
+        || branch->tables.size() < FLAGS_ncrp_max_branches;
+
+    // Drop leaves that lost their last document
+    for (int i = branch->tables.size()-1; i >= 0; i--) {
+        if (branch->tables[i]->ndsum == 0) {
+            collect_node(branch->tables[i]);  // removes itself from branch->tables
+        }
+    }
+
+    // Probability of the chain itself, shared by every option
+    for (current = root; ; current = current->tables[0]) {
+        if (current->prev.empty()) {
+            current->lp = 0;
+        } else if (Policy::m_dependent_gamma) {
+            current->lp = log(current->ndsum) - log((_gamma + 1) * current->prev[0]->ndsum - 1) + current->prev[0]->lp;
+        } else {
+            current->lp = log(current->ndsum) - log(_gamma + current->prev[0]->ndsum - 1) + current->prev[0]->lp;
+        }
+        current->lp += level_data_log_likelihood<Policy>(current,
+                nw_removed[current->level], nwsum_removed[current->level]);
+        if (current == branch) {
+            break;
+        }
+    }
+    // Taking a new table at the branching node
+    double lp_norm;
+    if (Policy::m_dependent_gamma) {
+        lp_norm = log((_gamma + 1) * branch->ndsum - 1);
+    } else {
+        lp_norm = log(_gamma + branch->ndsum - 1);
+    }
+
+    unsigned leaves = branch->tables.size();
+    lp_c_d->reserve(lp_c_d->size() + leaves + 1);
+    c_d->reserve(c_d->size() + leaves + 1);
+
+    if (new_table_allowed) {
+        double prob = branch->lp - lp_norm;
+        if (Policy::m_dependent_gamma) {
+            prob += log(_gamma * branch->ndsum);
+        } else {
+            prob += log(_gamma);
+        }
+        prob += _lp_new_chain[max_depth-1];
+
+        lp_c_d->push_back(prob);
+        c_d->push_back(branch);
+    }
+
+    // Only the leaf level differs between the existing paths
+    WordToCountMap& nw_removed_leaf = nw_removed[max_depth-1];
+    unsigned nwsum_removed_leaf = nwsum_removed[max_depth-1];
+    double lp_chain = branch->lp - lp_norm;
+    for (unsigned i = 0; i < leaves; i++) {
+        CRP* leaf = branch->tables[i];
+        leaf->lp = lp_chain + log(leaf->ndsum)
+            + level_data_log_likelihood<Policy>(leaf, nw_removed_leaf, nwsum_removed_leaf);
+
+        lp_c_d->push_back(leaf->lp);
+        c_d->push_back(leaf);
+    }
+    return true;
+}
+
 // Returns the list of nodes in the path containing node extending to depth
 // depth.. If node is internal, then it grows down upto depth depth. If node is
 // a leaf, then it just returns the path to the root
@@ -469,8 +641,7 @@ void NCRPBase::graft_path_at(CRP* node, vector<CRP*>* chain, unsigned depth) {
         current = node;
         for (int l = node->level+1; l < depth; l++) {
             // create a new chain of restaurants
-            CRP* new_crp = new CRP(l, 0, current);  // add back pointer
-            current->tables.push_back(new_crp);  // add forward pointer
+            CRP* new_crp = graft_node(l, current);
             // LOG(INFO) << "r " << current->tables.size();
             CHECK(FLAGS_ncrp_max_branches == -1 || current->tables.size() <= FLAGS_ncrp_max_branches);
             chain->push_back(new_crp);
@@ -481,6 +652,42 @@ void NCRPBase::graft_path_at(CRP* node, vector<CRP*>* chain, unsigned depth) {
     }
 }
 
+CRP* NCRPBase::graft_node(unsigned level, CRP* parent) {
+    CRP* node = new CRP(level, 0, parent);  // add back pointer
+    parent->tables.push_back(node);  // add forward pointer
+    _stats.add_node(level);
+    return node;
+}
+
+void NCRPBase::collect_node(CRP* node) {
+    CHECK(node != _ncrp_root) << "tried to delete the root!";
+
+    // Account for the whole subtree, since the destructor recurses
+    deque<CRP*> node_queue;
+    node_queue.push_back(node);
+    while (!node_queue.empty()) {
+        CRP* current = node_queue.front();
+        node_queue.pop_front();
+
+        _stats.remove_node(current->level);
+        _stats.ndsum -= current->ndsum;
+        _stats.nwsum -= current->nwsum;
+
+        node_queue.insert(node_queue.end(), current->tables.begin(),
+                current->tables.end());
+    }
+    delete node;
+}
+
+string NCRPBase::tree_stats_summary() {
+    vector<string> per_level;
+    for (int l = 0; l < _stats.nodes_at_level.size(); l++) {
+        per_level.push_back(StringPrintf("%d", _stats.nodes_at_level[l]));
+    }
+    return StringPrintf("%d nodes [%s] ndsum = %d nwsum = %d", _stats.nodes,
+            JoinStrings(per_level, " ").c_str(), _stats.ndsum, _stats.nwsum);
+}
+
 
 
 // Write out all the data in an intermediate format
@@ -568,6 +775,9 @@ bool NCRPBase::tree_is_consistent() {
     node_queue.push_back(_ncrp_root);
 
     unsigned total_words = 0;
+    unsigned total_nodes = 0;
+    unsigned total_ndsum = 0;
+    vector<unsigned> total_nodes_at_level;
 
     // check for empty nodes
     while (!node_queue.empty()) {
@@ -575,6 +785,12 @@ bool NCRPBase::tree_is_consistent() {
         node_queue.pop_front();
 
         CHECK(current);  // node exists
+        total_nodes += 1;
+        total_ndsum += current->ndsum;
+        if (current->level >= total_nodes_at_level.size()) {
+            total_nodes_at_level.resize(current->level+1, 0);
+        }
+        total_nodes_at_level[current->level] += 1;
         // node has documents
         CHECK_GT(current->ndsum, 0) << "node [" << current->label << "] has no docs.";
 
@@ -626,6 +842,17 @@ bool NCRPBase::tree_is_consistent() {
 
     CHECK_EQ(total_words, _total_word_count);
 
+    // check that the incremental tree stats haven't drifted
+    CHECK_EQ(total_nodes, _stats.nodes);
+    CHECK_EQ(total_words, _stats.nwsum);
+    CHECK_EQ(total_ndsum, _stats.ndsum);
+    // nodes_at_level only grows, so it may have trailing empty levels
+    CHECK_GE(_stats.nodes_at_level.size(), total_nodes_at_level.size());
+    for (int l = 0; l < _stats.nodes_at_level.size(); l++) {
+        unsigned count = l < total_nodes_at_level.size() ? total_nodes_at_level[l] : 0;
+        CHECK_EQ(count, _stats.nodes_at_level[l]) << "level " << l;
+    }
+
     // Check we visited everything
     for (DocumentMap::const_iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
         unsigned d = d_itr->first;
@@ -653,6 +880,13 @@ bool NCRPBase::tree_is_consistent() {
 
 // Prints out the top few features from each cluster
 void  NCRPBase::print_summary() {
+    LOG(INFO) << "tree: " << tree_stats_summary();
+
+    // Dumping every node is only worth the tree walk when asked for
+    if (!VLOG_IS_ON(1)) {
+        return;
+    }
+
     // Loop over every node in the tree using a level-by-level traversal,
     // ensuring that each time we visit a node, we have already calculated the
     // path probability up to its parent
@@ -667,10 +901,10 @@ void  NCRPBase::print_summary() {
 
         string buffer = show_chopped_sorted_nw(current->nw);
         if (current->level != _L-1) {
-            LOG(INFO) << "N[depth=" << current->level << "] (docs=" << current->ndsum << ") (%w=" << StringPrintf("%.3f\%", current->nwsum / (double)_total_word_count)  
+            VLOG(1) << "N[depth=" << current->level << "] (docs=" << current->ndsum << ") (%w=" << StringPrintf("%.3f\%", current->nwsum / (double)_total_word_count)  
                 << ") " << " " << buffer;
         } else {
-            LOG(INFO) << "L[" << l << "] (docs=" << current->ndsum << ") " << " " << buffer;
+            VLOG(1) << "L[" << l << "] (docs=" << current->ndsum << ") " << " " << buffer;
             l += 1;
         }
 
@@ -102,6 +102,45 @@ DECLARE_bool(ncrp_prix_fixe);
 // nodes, as opposed to leaves
 DECLARE_double(ncrp_eta_depth_scale);
 
+// Compile-time view of the flags consulted inside the path probability
+// kernel. The flags are fixed for the whole run, so one kernel is instantiated
+// per combination and selected once at startup instead of re-testing them for
+// every node in the tree.
+template <bool kMDependentGamma, bool kEtaDepthScale, bool kPrixFixe, bool kMaxBranches>
+struct PathKernelPolicy {
+    static const bool m_dependent_gamma = kMDependentGamma;  // ncrp_m_dependent_gamma
+    static const bool eta_depth_scale = kEtaDepthScale;  // ncrp_eta_depth_scale < 1
+    static const bool prix_fixe = kPrixFixe;  // ncrp_prix_fixe
+    static const bool max_branches = kMaxBranches;  // ncrp_max_branches != -1
+};
+
+// Aggregate statistics of the topic tree. These are updated as nodes are
+// grafted and collected (and as documents enter and leave the tree), so
+// reporting them doesn't require walking the tree.
+struct TreeStats {
+    TreeStats() : nodes(0), ndsum(0), nwsum(0) { }
+
+    void add_node(unsigned level) {
+        if (level >= nodes_at_level.size()) {
+            nodes_at_level.resize(level+1, 0);
+        }
+        nodes_at_level[level] += 1;
+        nodes += 1;
+    }
+
+    void remove_node(unsigned level) {
+        CHECK_LT(level, nodes_at_level.size());
+        CHECK_GT(nodes_at_level[level], 0);
+        nodes_at_level[level] -= 1;
+        nodes -= 1;
+    }
+
+    unsigned nodes;  // total number of nodes in the tree
+    vector<unsigned> nodes_at_level;  // number of nodes at each level
+    unsigned ndsum;  // sum of ndsum over all nodes
+    unsigned nwsum;  // sum of nwsum over all nodes
+};
+
 // The hLDA base class, contains code common to the Multinomial (fixed-depth)
 // and GEM (infinite-depth) samplers
 class NCRPBase : public GibbsSampler {
@@ -134,7 +173,22 @@ class NCRPBase : public GibbsSampler {
         virtual void resample_posterior_z_for(unsigned d, bool remove) = 0;
         void resample_posterior_c_for(unsigned d);
 
+        // Dispatches to the path kernel instantiated for the current flags
         void calculate_path_probabilities_for_subtree(CRP* root,
+                unsigned d,
+                unsigned max_depth,
+                LevelWordToCountMap& nw_removed,
+                LevelToCountMap& nwsum_removed,
+                vector<double>* lp_c_d,
+                vector<CRP*>* c_d) {
+            (this->*_path_kernel)(root, d, max_depth, nw_removed, nwsum_removed, lp_c_d, c_d);
+        }
+
+        typedef void (NCRPBase::*PathProbabilityKernel)(CRP*, unsigned, unsigned,
+                LevelWordToCountMap&, LevelToCountMap&, vector<double>*, vector<CRP*>*);
+
+        template <class Policy>
+        void calculate_path_probabilities_kernel(CRP* root,
                 unsigned d,
                 unsigned max_depth,
                 LevelWordToCountMap& nw_removed,
@@ -142,6 +196,23 @@ class NCRPBase : public GibbsSampler {
                 vector<double>* lp_c_d,
                 vector<CRP*>* c_d);
 
+        template <class Policy>
+        bool calculate_prix_fixe_path_probabilities(CRP* root,
+                unsigned d,
+                unsigned max_depth,
+                LevelWordToCountMap& nw_removed,
+                LevelToCountMap& nwsum_removed,
+                vector<double>* lp_c_d,
+                vector<CRP*>* c_d);
+
+        template <class Policy>
+        double level_data_log_likelihood(CRP* node,
+                WordToCountMap& nw_removed_l,
+                unsigned nwsum_removed_l);
+
+        // Picks the kernel instantiation matching the command line flags
+        static PathProbabilityKernel select_path_probability_kernel();
+
         virtual double compute_log_likelihood() = 0;
 
         bool tree_is_consistent();  // check the consistency of the tree
@@ -151,6 +222,15 @@ class NCRPBase : public GibbsSampler {
         // root
         void graft_path_at(CRP* node, vector<CRP*>* chain, unsigned depth);
 
+        // Creates a new node hanging off of parent, updating the tree stats
+        CRP* graft_node(unsigned level, CRP* parent);
+
+        // Deletes node along with its subtree, updating the tree stats
+        void collect_node(CRP* node);
+
+        // Returns a one-line description of the tree stats
+        string tree_stats_summary();
+
         void print_summary();
 
     protected:
@@ -170,7 +250,14 @@ class NCRPBase : public GibbsSampler {
         CRP* _ncrp_root;  // tree representation of the nCRP.
         CRP* _reject_node;  // special node containing rejected attributes.
 
-        unsigned _unique_nodes;  // number of leaves in the tree
+        TreeStats _stats;  // node counts and count aggregates for the tree
+
+        PathProbabilityKernel _path_kernel;  // selected from the flags at startup
+
+        // eta scaling factors per level and scratch space for the per-level
+        // data likelihood of a freshly grafted chain
+        vector<double> _eta_depth_scale;
+        vector<double> _lp_new_chain;
 
         string _filename;  // output file name
 
@@ -15,6 +15,7 @@
 */
 #include <math.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include <algorithm>
 
@@ -63,6 +64,57 @@ DEFINE_bool(cc_include_noise_view,
             false,
             "Should the first view be confined to a single cluster.");
 
+// If toggled, feature moves are focused on the features whose view
+// assignment is still uncertain, instead of being spread evenly
+DEFINE_bool(cc_adaptive_feature_moves,
+            false,
+            "Focus feature moves on features with uncertain views.");
+
+// If toggled, each feature move is a Gibbs step over all the views instead of
+// an MH proposal to a random view
+DEFINE_bool(cc_gibbs_feature_moves,
+            false,
+            "Resample feature views with Gibbs steps instead of MH.");
+
+// Every feature keeps at least this much weight in the adaptive scheduler, so
+// none of them stop being proposed altogether
+const double kMinMobility = 0.05;
+
+void view_document::add(unsigned w, unsigned count) {
+    vector<pair<unsigned, unsigned> >::iterator itr = lower_bound(
+            features.begin(), features.end(), make_pair(w, 0u));
+    CHECK(itr == features.end() || itr->first != w);
+    features.insert(itr, make_pair(w, count));
+    total += count;
+}
+
+void view_document::remove(unsigned w) {
+    vector<pair<unsigned, unsigned> >::iterator itr = lower_bound(
+            features.begin(), features.end(), make_pair(w, 0u));
+    CHECK(itr != features.end() && itr->first == w);
+    total -= itr->second;
+    features.erase(itr);
+}
+
+CrossCatMM::~CrossCatMM() {
+    for (int m = 0; m < _view_random.size(); m++) {
+        delete_thread_random(_view_random[m]);
+    }
+}
+
+void collapsed_document_collection::push_back(const Document& doc) {
+    vector<unsigned> words(doc);
+    sort(words.begin(), words.end());
+    for (int n = 0; n < words.size(); n++) {
+        if (n > 0 && words[n] == words[n-1]) {
+            entries.back().second += 1;
+        } else {
+            entries.push_back(make_pair(words[n], 1u));
+        }
+    }
+    offsets.push_back(entries.size());
+}
+
 const string kDirichletProcess = "dirichlet-process";
 const string kDirichletMixture = "dirichlet";
 const string kUniformMixture = "uniform";
@@ -84,6 +136,11 @@ void CrossCatMM::batch_allocation() {
 
     // Keep track of the number of clusters in each view
     _current_component.resize(FLAGS_M);
+    _view_c_proposed.assign(FLAGS_M, 0);
+    _view_c_failed.assign(FLAGS_M, 0);
+    _view_scorer.resize(FLAGS_M);
+    _view_split_merge.resize(FLAGS_M);
+    _view_scores.resize(FLAGS_M);
 
     // Allocate the initial clusters
     for (int m = 0; m < FLAGS_M; m++) {
@@ -110,6 +167,38 @@ void CrossCatMM::batch_allocation() {
         VLOG(1) << _word_id_to_name[w] << " assigned to view " << _m[w];
     }
 
+    // Collapse the documents and compute per-view feature marginals. This
+    // goes in document order so that document d ends up at collapsed[d]. Only
+    // the per-view split and the posting lists are kept; the collapsed
+    // documents themselves aren't needed once those are built.
+    collapsed_document_collection collapsed;
+    _postings.clear();
+    _postings.resize(_lV);
+    _DV.clear();
+    _DV.resize(_D.size());
+    for (int d = 0; d < _D.size(); d++) {
+        DocumentMap::const_iterator d_itr = _D.find(d);
+        CHECK(d_itr != _D.end()) << "documents must be numbered consecutively";
+        collapsed.push_back(d_itr->second);
+
+        _DV[d].resize(FLAGS_M);
+        for (int i = 0; i < collapsed.size(d); i++) {
+            const pair<unsigned, unsigned>& entry = collapsed.at(d, i);
+            unsigned w = entry.first;
+            _postings[w].push_back(make_pair(d, entry.second));
+
+            // This will store the marginal information about the frequency of
+            // w, so we can compute a ranked list of features for each one.
+            _b[_m[w]].nw[w] += entry.second;
+            _b[_m[w]].nwsum += entry.second;
+
+            // collapsed is ordered by feature, so these stay sorted
+            view_document& dv = _DV[d][_m[w]];
+            dv.features.push_back(entry);
+            dv.total += entry.second;
+        }
+    }
+
     // Add the documents into the clustering
     _lD = 0;  // reset this to make the resample_posterior_z stuff below work correctly
     for (DocumentMap::iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
@@ -120,22 +209,6 @@ void CrossCatMM::batch_allocation() {
         t.set_empty_key(kEmptyUnsignedKey);
         _z.insert(pair<unsigned,cluster_map>(d, t));
         // _z[d].set_empty_key(kEmptyUnsignedKey);
-        
-        // Allocate this doc in the collapsed vector
-        collapsed_document temp;
-        // temp.set_empty_key(kEmptyUnsignedKey);
-        _DD.insert(pair<unsigned,collapsed_document>(d, temp));
-
-        // Collapse the document and compute per-view feature marginals
-        for (int n = 0; n < d_itr->second.size(); n++) {
-            unsigned w = d_itr->second[n];
-            _DD[d][w] += 1;
-
-            // This will store the marginal information about the frequency of
-            // w, so we can compute a ranked list of features for each one.
-            _b[_m[w]].nw[w] += 1;
-            _b[_m[w]].nwsum += 1;
-        }
 
         // TODO: deallocate the original _D
 
@@ -144,6 +217,9 @@ void CrossCatMM::batch_allocation() {
             for (int m = 0; m < FLAGS_M; m++) {
                 _z[d][m] = sample_integer(_c[m].size());
                 _c[m][_z[d][m]].ndsum += 1; // Can't use ADD b/c we need to maintain ndsum over all the views
+                if (_DV[d][m].total > 0) {
+                    _c[m][_z[d][m]].nonzero_ndsum += 1;
+                }
             }
 
             // Initial level assignments
@@ -197,139 +273,164 @@ void CrossCatMM::batch_allocation() {
 }
 
 void CrossCatMM::resample_posterior_m(double percent) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
     _m_proposed = _m_failed = 0;
-    for (int f = 0; f < _lV; f++) {
-        if (sample_uniform() < percent) {
-            resample_posterior_m_for(f);
+    double accept_prob;
+    if (FLAGS_cc_adaptive_feature_moves) {
+        // Same expected number of proposals as below, but spent unevenly
+        double expected = percent * _lV;
+        unsigned budget = (unsigned)expected;
+        if (sample_uniform() < expected - budget) {
+            budget += 1;
+        }
+        vector<unsigned> features;
+        choose_adaptive_features(budget, &features);
+        for (int i = 0; i < features.size(); i++) {
+            unsigned f = features[i];
+            if (resample_posterior_m_for(f, &accept_prob)) {
+                // Running mean, so the selection probabilities settle down
+                // as each feature's history grows (diminishing adaptation);
+                // with a constant rate the scan order would keep chasing
+                // the current state and the chain wouldn't be guaranteed to
+                // leave the posterior invariant
+                _feature_proposals[f] += 1;
+                _feature_mobility[f] += (accept_prob - _feature_mobility[f])
+                    / (1.0 + _feature_proposals[f]);
+            }
+        }
+    } else {
+        for (int f = 0; f < _lV; f++) {
+            if (sample_uniform() < percent) {
+                resample_posterior_m_for(f, &accept_prob);
+            }
         }
     }
+
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
     LOG(INFO) << _m_proposed-_m_failed << " / " << _m_proposed << " " 
-        << StringPrintf("(%.3f%%)", 100 - _m_failed / (double)_m_proposed*100) << " feature-view moves.";
+        << StringPrintf("(%.3f%%)", 100 - _m_failed / (double)_m_proposed*100) << " feature-view moves"
+        << StringPrintf(" (%.1f proposals/s).", _m_proposed / max(seconds, 1e-6));
+}
+
+// Picks budget features to propose moves for (with replacement), each one
+// with probability proportional to its mobility. Every feature keeps some
+// weight, so each one is still updated infinitely often.
+void CrossCatMM::choose_adaptive_features(unsigned budget, vector<unsigned>* features) {
+    if (_feature_mobility.size() != _lV) {
+        // Start out optimistic so every feature gets tried early on
+        _feature_mobility.assign(_lV, 1.0);
+        _feature_proposals.assign(_lV, 0);
+    }
+
+    vector<double> cumulative(_lV);
+    double total = 0;
+    for (int w = 0; w < _lV; w++) {
+        total += kMinMobility + _feature_mobility[w];
+        cumulative[w] = total;
+    }
+
+    features->clear();
+    for (int i = 0; i < budget; i++) {
+        unsigned w = upper_bound(cumulative.begin(), cumulative.end(),
+                sample_uniform() * total) - cumulative.begin();
+        features->push_back(min(w, _lV - 1));
+    }
 }
 
 // Performs a single document's level assignment resample step
+// Only touches view m's state, so different views can be resampled at once
 void CrossCatMM::resample_posterior_z_for(unsigned d, unsigned m, bool remove) {
-    clustering& cm = _c[m];
+    clustering& cm = _c.find(m)->second;
+    cluster_map& zd = _z.find(d)->second;
+    const vector<pair<unsigned, unsigned> >& features = _DV[d][m].features;
+    unsigned total_removed_count = _DV[d][m].total;
 
     unsigned old_zdm = 0;
-    
-    unsigned total_removed_count = 0;
-    for (collapsed_document::iterator d_itr = _DD[d].begin();
-            d_itr != _DD[d].end();
-            d_itr++) {
-        unsigned w = d_itr->first;
-        unsigned count = d_itr->second;
-        if (_m[w] == m) {
-            total_removed_count += count;
-        }
-    }
 
     if (remove) {
-        old_zdm = _z[d][m];
+        old_zdm = zd[m];
         // Remove this document from this clustering
-        for (collapsed_document::iterator d_itr = _DD[d].begin();
-                d_itr != _DD[d].end();
-                d_itr++) {
-            unsigned w = d_itr->first;
-            unsigned count = d_itr->second;
-            if (_m[w] == m) {
-                // Remove this document and word from the counts
-                cm[old_zdm].nw[w] -= count;  // # of words in topic z equal to w
-                CHECK_GE(cm[old_zdm].nw[w], 0);
-            }
+        CRP& cluster = cm[old_zdm];
+        for (int i = 0; i < features.size(); i++) {
+            unsigned w = features[i].first;
+            unsigned count = features[i].second;
+            // Remove this document and word from the counts
+            cluster.nw[w] -= count;  // # of words in topic z equal to w
+            CHECK_GE(cluster.nw[w], 0);
         }
-        CHECK_GT(cm[old_zdm].ndsum, 0);
+        CHECK_GT(cluster.ndsum, 0);
 
-        cm[old_zdm].nwsum -= total_removed_count;  // # of words in topic z
-        cm[old_zdm].ndsum -= 1;  // # of docs in topic
+        cluster.nwsum -= total_removed_count;  // # of words in topic z
+        cluster.ndsum -= 1;  // # of docs in topic
+        if (total_removed_count > 0) {
+            cluster.nonzero_ndsum -= 1;
+        }
 
-        CHECK_GE(cm[old_zdm].nwsum, 0);
-        CHECK_LE(cm[old_zdm].ndsum, _lD);
+        CHECK_GE(cluster.nwsum, 0);
+        CHECK_LE(cluster.ndsum, _lD);
     }
 
     // Compute the log likelihood of each cluster assignment given all the other
     // document-cluster assignments
-    vector<pair<unsigned,double> > lp_z_d;
-    for (clustering::iterator itr = cm.begin();
-            itr != cm.end();
-            itr++) {
-        unsigned l = itr->first;
-
-        double sum = 0;
-        
-        // First add in the prior over the clusters
-        sum += log(cm[l].ndsum) - log(_lD - 1 + FLAGS_mm_alpha);
+    MixtureScorer& scorer = _view_scorer[m];
+    scorer.load(cm);
+    double new_cluster_score = scorer.score(features, total_removed_count,
+            _eta, _eta_sum, &_view_scores[m]);
+    const vector<double>& scores = _view_scores[m];
 
-        // Add in the normalizer for the multinomial-dirichlet likelihood
-        sum += gammaln(_eta_sum + cm[l].nwsum) - gammaln(_eta_sum + cm[l].nwsum + total_removed_count);
-
-        // Now account for the likelihood of the data (marginal posterior of
-        // DP-Mult)
-        for (collapsed_document::iterator d_itr = _DD[d].begin();
-                d_itr != _DD[d].end();
-                d_itr++) {
-            unsigned w = d_itr->first;
-            unsigned count = d_itr->second;
-
-            if (_m[w] == m) {
-                sum += gammaln(_eta[w] + count + cm[l].nw[w]) - gammaln(_eta[w] + cm[l].nw[w]);
-            }
-        }
-        lp_z_d.push_back(pair<unsigned,double>(l, sum));
+    vector<pair<unsigned,double> > lp_z_d;
+    for (int k = 0; k < scorer.size(); k++) {
+        // Prior over the clusters plus the multinomial-dirichlet likelihood of
+        // the data (marginal posterior of DP-Mult)
+        double sum = log(scorer.ndsum(k)) - log(_lD - 1 + FLAGS_mm_alpha) + scores[k];
+        lp_z_d.push_back(pair<unsigned,double>(scorer.id(k), sum));
     }
 
 
     // Add an additional new component if not in the noise view
     if (cm.size() < FLAGS_KMAX || FLAGS_KMAX==-1) {
         if (m != 0 || !FLAGS_cc_include_noise_view) {
-            double sum = log(FLAGS_mm_alpha) - log(_lD - 1 + FLAGS_mm_alpha);
-            // Add in the normalizer for the multinomial-dirichlet likelihood
-            sum += gammaln(_eta_sum) - gammaln(_eta_sum + total_removed_count);
-            for (collapsed_document::iterator d_itr = _DD[d].begin();
-                    d_itr != _DD[d].end();
-                    d_itr++) {
-                unsigned w = d_itr->first;
-                unsigned count = d_itr->second;
-                if (_m[w] == m) {
-                    sum += gammaln(_eta[w] + count) - gammaln(_eta[w]);
-                }
-            }
+            double sum = log(FLAGS_mm_alpha) - log(_lD - 1 + FLAGS_mm_alpha) + new_cluster_score;
             lp_z_d.push_back(pair<unsigned,double>(_current_component[m], sum));
         }
     }
 
     // Update the assignment
-    _z[d][m] = sample_unnormalized_log_multinomial(&lp_z_d);
-    VLOG(1) << "resampling posterior z for " << d << "," << m << ": " << old_zdm << "->" << _z[d][m];
+    zd[m] = sample_unnormalized_log_multinomial(&lp_z_d);
+    VLOG(1) << "resampling posterior z for " << d << "," << m << ": " << old_zdm << "->" << zd[m];
 
-    unsigned new_zdm = _z[d][m];
+    unsigned new_zdm = zd[m];
 
     if (new_zdm == old_zdm) {
-        _c_failed += 1;
+        _view_c_failed[m] += 1;
     }
-    _c_proposed += 1;
+    _view_c_proposed[m] += 1;
 
     // Update the counts
-    for (collapsed_document::iterator d_itr = _DD[d].begin();
-            d_itr != _DD[d].end();
-            d_itr++) {
-        unsigned w = d_itr->first;
-        unsigned count = d_itr->second;
-
-        if (_m[w] == m) {
-            cm[new_zdm].nw[w] += count;  // number of words in topic z equal to w
-        }
+    CRP& new_cluster = cm[new_zdm];
+    for (int i = 0; i < features.size(); i++) {
+        unsigned w = features[i].first;
+        unsigned count = features[i].second;
+        new_cluster.nw[w] += count;  // number of words in topic z equal to w
+    }
+    new_cluster.nwsum += total_removed_count;  // number of words in topic z
+    new_cluster.ndsum += 1;  // number of words in doc d with topic z
+    if (total_removed_count > 0) {
+        new_cluster.nonzero_ndsum += 1;
     }
-    cm[new_zdm].nwsum += total_removed_count;  // number of words in topic z
-    cm[new_zdm].ndsum += 1;  // number of words in doc d with topic z
 
-    CHECK_LE(cm[new_zdm].ndsum, _lD);
+    CHECK_LE(new_cluster.ndsum, _lD);
 
     // Clean up for the DPCrossCatMM
     if (cm[old_zdm].ndsum == 0) {  // empty component
         // LOG(INFO) << "removing cluster " << old_zdm << " from view "  << m << " because we chose cluster " << new_zdm;
         // _c.erase(old_zdm);
-        _c[m].erase(old_zdm);
+        cm.erase(old_zdm);
     }
     // Make room for a new component if we selected the new one
     if (new_zdm == _current_component[m]) {
@@ -337,27 +438,165 @@ void CrossCatMM::resample_posterior_z_for(unsigned d, unsigned m, bool remove) {
     }
 }
 
-// Likelihood of a particular cross-cat clustering of a particular word
-double CrossCatMM::cross_cat_clustering_log_likelihood(unsigned w, unsigned m) {
-    double log_lik = 0;
-    
-    // Likelihood of this particular feature w belonging to this view
-    for (clustering::iterator c_itr = _c[m].begin();
-            c_itr != _c[m].end();
-            c_itr++) {
-        CRP& cluster = c_itr->second;
-        log_lik += gammaln(_eta_sum) - gammaln(_eta_sum + cluster.nwsum) +
-            gammaln(_eta[w]+cluster.nw[w]) - gammaln(_eta[w]);
+// Resamples every document's cluster in view m
+void CrossCatMM::resample_posterior_z_view(unsigned m) {
+    for (int d = 0; d < _DV.size(); d++) {
+        resample_posterior_z_for(d, m, true);
     }
+    resample_split_merge_view(m);
+}
+
+// Moves document d to cluster new_zdm in view m, dropping its old cluster if
+// that leaves it empty
+void CrossCatMM::move_to_cluster(unsigned d, unsigned m, unsigned new_zdm) {
+    clustering& cm = _c.find(m)->second;
+    unsigned& zdm = _z.find(d)->second[m];
+    const view_document& dv = _DV[d][m];
 
-    // Prior over the featurecluster assignments
-    log_lik += log(_b[m].ndsum + _xi[m]) - log(_lV+_xi_sum);
-    // log_lik += log(_b[m].ndsum) - log(_lV - 1 + FLAGS_cc_xi);
+    CRP& old_cluster = cm[zdm];
+    for (int i = 0; i < dv.features.size(); i++) {
+        old_cluster.nw[dv.features[i].first] -= dv.features[i].second;
+    }
+    old_cluster.nwsum -= dv.total;
+    old_cluster.ndsum -= 1;
+    if (dv.total > 0) {
+        old_cluster.nonzero_ndsum -= 1;
+    }
+    if (old_cluster.ndsum == 0) {
+        cm.erase(zdm);
+    }
 
+    CRP& new_cluster = cm[new_zdm];
+    for (int i = 0; i < dv.features.size(); i++) {
+        new_cluster.nw[dv.features[i].first] += dv.features[i].second;
+    }
+    new_cluster.nwsum += dv.total;
+    new_cluster.ndsum += 1;
+    if (dv.total > 0) {
+        new_cluster.nonzero_ndsum += 1;
+    }
+
+    zdm = new_zdm;
+}
+
+// Makes this sweep's split-merge proposals in view m. Only touches view m's
+// state, like resample_posterior_z_for.
+void CrossCatMM::resample_split_merge_view(unsigned m) {
+    if (!split_merge_enabled_for(m) || (m == 0 && FLAGS_cc_include_noise_view)
+            || _lD < 2) {
+        return;
+    }
+    clustering& cm = _c.find(m)->second;
+
+    unsigned proposals = split_merge_proposals(_lD);
+    if (proposals == 0) {
+        return;
+    }
+
+    // Index the clusters' documents once for the whole batch of proposals
+    ClusterMembers index;
+    for (int d = 0; d < _DV.size(); d++) {
+        index.add(_z.find(d)->second.find(m)->second, d);
+    }
+
+    for (int p = 0; p < proposals; p++) {
+        // Pick the two anchors
+        unsigned i = sample_integer(_lD);
+        unsigned j = sample_integer(_lD - 1);
+        if (j >= i) {
+            j += 1;
+        }
+        unsigned ci = _z.find(i)->second[m];
+        unsigned cj = _z.find(j)->second[m];
+
+        // Don't split past the cluster limit
+        if (ci == cj && FLAGS_KMAX != -1 && cm.size() >= FLAGS_KMAX) {
+            continue;
+        }
+
+        // Gather up everything in the anchors' clusters
+        vector<unsigned> members;
+        index.gather(i, ci, j, cj, &members);
+        vector<const feature_counts*> docs;
+        vector<unsigned> totals;
+        vector<unsigned> side;
+        for (int k = 0; k < members.size(); k++) {
+            unsigned d = members[k];
+            docs.push_back(&_DV[d][m].features);
+            totals.push_back(_DV[d][m].total);
+            side.push_back((ci != cj && _z.find(d)->second[m] == cj) ? 1 : 0);
+        }
+
+        if (!split_merge_move(docs, totals, FLAGS_mm_alpha, _eta, _eta_sum,
+                    &_view_scorer[m], &side, &_view_split_merge[m])) {
+            continue;
+        }
+
+        index.apply(members, side, ci, cj, _current_component[m]);
+        if (ci == cj) {
+            // The documents on side 1 make up a brand new cluster
+            unsigned new_zdm = _current_component[m];
+            _current_component[m] += 1;
+            for (int k = 0; k < members.size(); k++) {
+                if (side[k] == 1) {
+                    move_to_cluster(members[k], m, new_zdm);
+                }
+            }
+        } else {
+            for (int k = 0; k < members.size(); k++) {
+                if (_z.find(members[k])->second[m] == cj) {
+                    move_to_cluster(members[k], m, ci);
+                }
+            }
+        }
+    }
+}
+
+void CrossCatMM::resample_posterior_z_view_task(void* context, unsigned m) {
+    ((CrossCatMM*)context)->resample_posterior_z_view(m);
+}
+
+// Count of feature w that each cluster of view m holds (or would hold, if w
+// were moved into m). Only the clusters that w's documents fall in show up.
+void CrossCatMM::feature_cluster_counts(unsigned w, unsigned m, cluster_map* counts) {
+    counts->set_empty_key(kEmptyUnsignedKey);
+    const posting_list& postings = _postings[w];
+    for (int i = 0; i < postings.size(); i++) {
+        (*counts)[_z.find(postings[i].first)->second.find(m)->second] += postings[i].second;
+    }
+}
+
+// Unnormalized log conditional of feature w being in view m, holding every
+// view's clustering fixed, given w's per-cluster counts in m. With w taken out
+// of the model, putting it in view m only changes the clusters of m that w's
+// documents fall in: each such cluster k picks up c_k counts of w, scaling its
+// marginal likelihood by
+//
+//   Gamma(eta_w + c_k) / Gamma(eta_w) * Gamma(eta_sum + N_k) / Gamma(eta_sum + N_k + c_k)
+//
+// where N_k is the cluster's size without w.
+double CrossCatMM::feature_view_log_conditional(unsigned w, unsigned m,
+        const cluster_map& counts) {
+    bool current = (_m[w] == m);
+
+    // Prior over the feature-view assignments, with w removed
+    double log_lik = log(_b[m].ndsum - (current ? 1 : 0) + _xi[m]);
+
+    const clustering& cm = _c.find(m)->second;
+    for (cluster_map::const_iterator count_itr = counts.begin();
+            count_itr != counts.end();
+            count_itr++) {
+        unsigned count = count_itr->second;
+        clustering::const_iterator c_itr = cm.find(count_itr->first);
+        CHECK(c_itr != cm.end());
+        unsigned others = c_itr->second.nwsum - (current ? count : 0);
+        log_lik += log_gamma_ratio(_eta[w], count)
+            - log_gamma_ratio(_eta_sum + others, count);
+    }
     return log_lik;
 }
 
-double CrossCatMM::cross_cat_reassign_features(unsigned old_m, unsigned new_m, unsigned w) {
+void CrossCatMM::cross_cat_reassign_features(unsigned old_m, unsigned new_m, unsigned w) {
     if (old_m != new_m) {
         // Update counts
         _m[w] = new_m;
@@ -365,23 +604,36 @@ double CrossCatMM::cross_cat_reassign_features(unsigned old_m, unsigned new_m, u
         _b[new_m].ndsum += 1;
 
         // reassign the words temporarily; this has to loop over documents because
-        // we need to change what clusters the features get assigned to maybe
-        for (int d = 0; d < _DD.size(); d++) {
-            unsigned zdm_old = _z[d][old_m];
-            unsigned zdm_new = _z[d][new_m];
-
-            collapsed_document::iterator d_itr = _DD[d].find(w);
-            if (d_itr != _DD[d].end()) {
-                unsigned count = d_itr->second;
-                _c[old_m][zdm_old].nw[w] -= count;
-                _c[old_m][zdm_old].nwsum -= count;
-                
-                CHECK_GE(_c[old_m][zdm_old].nw[w], 0);
-                CHECK_GE(_c[old_m][zdm_old].nwsum, 0);
-
-                _c[new_m][zdm_new].nw[w] += count;
-                _c[new_m][zdm_new].nwsum += count;
+        // we need to change what clusters the features get assigned to maybe.
+        // Only the documents that actually contain w are affected.
+        clustering& c_old = _c[old_m];
+        clustering& c_new = _c[new_m];
+        const posting_list& postings = _postings[w];
+        for (int i = 0; i < postings.size(); i++) {
+            unsigned d = postings[i].first;
+            unsigned count = postings[i].second;
+            cluster_map& zd = _z[d];
+            CRP& cluster_old = c_old[zd[old_m]];
+            CRP& cluster_new = c_new[zd[new_m]];
+
+            cluster_old.nw[w] -= count;
+            cluster_old.nwsum -= count;
+
+            CHECK_GE(cluster_old.nw[w], 0);
+            CHECK_GE(cluster_old.nwsum, 0);
+
+            cluster_new.nw[w] += count;
+            cluster_new.nwsum += count;
+
+            // Keep track of documents leaving or entering a view entirely
+            _DV[d][old_m].remove(w);
+            if (_DV[d][old_m].total == 0) {
+                cluster_old.nonzero_ndsum -= 1;
+            }
+            if (_DV[d][new_m].total == 0) {
+                cluster_new.nonzero_ndsum += 1;
             }
+            _DV[d][new_m].add(w, count);
         }
 
         // Bookkeeping for the per-view feature marginals.
@@ -391,126 +643,98 @@ double CrossCatMM::cross_cat_reassign_features(unsigned old_m, unsigned new_m, u
     }
 }
 
-void CrossCatMM::resample_posterior_m_for(unsigned w) {
-    if (true) {
-        // Choose a new random cluster
-        unsigned new_m = sample_integer(_b.size());
-        unsigned old_m = _m[w];
-
-        VLOG(1) << "proposing to move [" << _word_id_to_name[w] << "] from " << old_m << " to " << new_m;
-
-        // Do a MH step
-        if (new_m != _m[w]) {
-            // XXX TODO: only need to compute ll over things that change
-            double current_likelihood = cross_cat_clustering_log_likelihood(w, _m[w]);
-
-            VLOG(1) << "current likelihood: " << current_likelihood;
-                
-            cross_cat_reassign_features(old_m, new_m, w);
-
-            double new_likelihood = cross_cat_clustering_log_likelihood(w, _m[w]);
+// Resamples the view of feature w, either with a Gibbs step over all the
+// views or an MH step to a random one. Returns whether a move was proposed,
+// and if so sets accept_prob to the probability of w leaving its view.
+bool CrossCatMM::resample_posterior_m_for(unsigned w, double* accept_prob) {
+    if (FLAGS_cc_gibbs_feature_moves) {
+        return gibbs_posterior_m_for(w, accept_prob);
+    }
 
-            VLOG(1) << "new likelihood: " << new_likelihood;
+    // Choose a new random cluster
+    unsigned new_m = sample_integer(_b.size());
+    unsigned old_m = _m[w];
 
-            if (log(sample_uniform()) < new_likelihood - current_likelihood) {
-                VLOG(1) << "MOVING [" << _word_id_to_name[w] << "] from " << old_m << " to " << new_m;
-            } else {
-                cross_cat_reassign_features(new_m, old_m, w);
-                _m_failed += 1;
-            }
+    VLOG(1) << "proposing to move [" << _word_id_to_name[w] << "] from " << old_m << " to " << new_m;
 
-            _m_proposed += 1;
-        }
-    } else {
-        // XXX: ratios of Dirichlet Processes won't really work; need to think
-        // through the math a little bit more. The problem is that the original
-        // clustering has a different number of clusters than the new one, and
-        // aynway it doesn't make sense to loop over cluster pairs. Really we
-        // need to integrate out the clustersings (marginalize over all possible
-        // clusterings in both cases). But this is unfortunately prohibitively
-        // expensive for DPMM.
-        /*
-        // Gibbs sampler for XCAT?
-        unsigned old_m = _m[w];
-
-        // Loop over all the documents and generate a hash of
-        // cluster->w_count for the old view (i.e. count deltas if w was
-        // removed from this view.
-        hash_map<unsigned, double> cluster_to_w_count;
-        for (int d = 0; d < _DD.size(); d++) {
-            collapsed_document::iterator d_itr = _DD[d].find(w);
-            if (d_itr != _DD[d].end()) {
-                cluster_to_w_count[_z[d][new_m]] += d_itr->second;
-            }
-        }
+    // Do a MH step; the proposal is scored before anything is moved, so
+    // rejected moves don't touch the clustering at all
+    if (new_m == old_m) {
+        return false;
+    }
 
+    // Both sides are scored from the affected clusters only, using the same
+    // conditional as the Gibbs update
+    cluster_map current_counts;
+    feature_cluster_counts(w, old_m, &current_counts);
+    double current_likelihood = feature_view_log_conditional(w, old_m, current_counts);
 
-        vector<pair<unsigned,double> > lp_m;
-        for (int new_m = 0; new_m < _b.size(); new_m++) {
-            double log_lik = 0;
+    VLOG(1) << "current likelihood: " << current_likelihood;
 
-            // cross_cat_reassign_features(old_m, new_m, w);
+    cluster_map new_counts;
+    feature_cluster_counts(w, new_m, &new_counts);
+    double new_likelihood = feature_view_log_conditional(w, new_m, new_counts);
 
-            // Loop over all the documents and generate a hash of
-            // cluster->w_count for the new_m view (i.e. count deltas if w was
-            // assigned to this view.
-            hash_map<unsigned, double> cluster_to_w_count;
-            for (int d = 0; d < _DD.size(); d++) {
-                collapsed_document::iterator d_itr = _DD[d].find(w);
-                if (d_itr != _DD[d].end()) {
-                    cluster_to_w_count[_z[d][new_m]] += d_itr->second;
-                }
-            }
+    VLOG(1) << "new likelihood: " << new_likelihood;
 
-            // TODO: XXX: the below is probably wrong; should be a ratio of C()s 
-            
-            // Likelihood of this particular feature w belonging to this view
-            for (clustering::iterator c_itr = _c[new_m].begin();
-                    c_itr != _c[new_m].end();
-                    c_itr++) {
-                unsigned c_id = c_itr->first;
-                CRP& cluster = c_itr->second;
-
-                if (new_m == old_m) {
-                    log_lik += gammaln(_eta_sum) - gammaln(_eta_sum + cluster.nwsum) +
-                        gammaln(_eta[w]+cluster.nw[w]) - gammaln(_eta[w]);
-                } else {
-                    CHECK_EQ(cluster.nw[w], 0);
-                    // x is the number of w for all docs in this cluster 
-                    unsigned x = cluster_t_w_count[c_id];
-
-                    log_lik += gammaln(_eta_sum) - gammaln(_eta_sum + cluster.nwsum) +
-                        gammaln(_eta[w]+cluster.nw[w]) - gammaln(_eta[w]);
-                }
+    *accept_prob = min(1.0, exp(new_likelihood - current_likelihood));
+    if (log(sample_uniform()) < new_likelihood - current_likelihood) {
+        VLOG(1) << "MOVING [" << _word_id_to_name[w] << "] from " << old_m << " to " << new_m;
+        cross_cat_reassign_features(old_m, new_m, w);
+    } else {
+        _m_failed += 1;
+    }
 
-            }
+    _m_proposed += 1;
+    return true;
+}
 
-            // Prior over the featurecluster assignments
-            // if (FLAGS_mm_prior == kDirichletMixture) {
-            if (new_m == old_m) {
-                log_lik += log(_b[new_m].ndsum+_xi[new_m]) - log(_lV+_xi_sum);
-            } else {
-                log_lik += log(_b[new_m].ndsum+1+_xi[new_m]) - log(_lV+_xi_sum);
-            }
-            // } else if (FLAGS_mm_prior == kDirichletProcess) {
-            //     log_lik += log(_b[new_m].ndsum) - log(_lV - 1 + FLAGS_cc_xi);
-            // }
+// Gibbs step for the view of feature w, holding every view's clustering
+// fixed (see feature_view_log_conditional). The per-cluster counts of w for
+// every view are gathered in one pass over w's posting list, so all the views
+// are scored in O(df(w) M) without moving w anywhere.
+bool CrossCatMM::gibbs_posterior_m_for(unsigned w, double* accept_prob) {
+    unsigned old_m = _m[w];
+    unsigned M = _b.size();
+
+    vector<cluster_map> counts(M);
+    for (int m = 0; m < M; m++) {
+        counts[m].set_empty_key(kEmptyUnsignedKey);
+    }
+    const posting_list& postings = _postings[w];
+    for (int i = 0; i < postings.size(); i++) {
+        const cluster_map& zd = _z.find(postings[i].first)->second;
+        for (int m = 0; m < M; m++) {
+            counts[m][zd.find(m)->second] += postings[i].second;
+        }
+    }
 
-            // cross_cat_reassign_features(new_m, old_m, w);
+    vector<pair<unsigned,double> > lp_m;
+    for (int m = 0; m < M; m++) {
+        lp_m.push_back(pair<unsigned,double>(m,
+                    feature_view_log_conditional(w, m, counts[m])));
+    }
 
-            lp_m.push_back(pair<unsigned,double>(new_m, log_lik));
-        }
+    // Probability of w leaving its current view, for the adaptive scheduler
+    double norm = lp_m[0].second;
+    for (int m = 1; m < M; m++) {
+        norm = max(norm, lp_m[m].second);
+    }
+    double total = 0;
+    for (int m = 0; m < M; m++) {
+        total += exp(lp_m[m].second - norm);
+    }
+    *accept_prob = 1.0 - exp(lp_m[old_m].second - norm) / total;
 
-        // Update the assignment
-        _m[w] = sample_unnormalized_log_multinomial(&lp_m);
-        if (_m[w] != old_m) {
-            VLOG(1) << "MOVING [" << _word_id_to_name[w] << "] from " << old_m << " to " << _m[w];
-            cross_cat_reassign_features(old_m, _m[w], w);
-        } else {
-            _m_failed += 1;
-        }
-        _m_proposed += 1;*/
+    unsigned new_m = sample_unnormalized_log_multinomial(&lp_m);
+    if (new_m != old_m) {
+        VLOG(1) << "MOVING [" << _word_id_to_name[w] << "] from " << old_m << " to " << new_m;
+        cross_cat_reassign_features(old_m, new_m, w);
+    } else {
+        _m_failed += 1;
     }
+    _m_proposed += 1;
+    return true;
 }
 
 double CrossCatMM::compute_log_likelihood() {
@@ -607,18 +831,48 @@ void CrossCatMM::resample_posterior() {
     }
 
     // Resample the cluster indicators
-    _c_proposed = _c_failed = 0;
-    for (int d = 0; d < _DD.size(); d++) {
-        // LOG(INFO) <<  "  resampling document " <<  d;
-        // For each clustering (view), resample this document's cluster indicator
-        for (multiple_clustering::iterator c_itr = _c.begin();
-                c_itr != _c.end();
-                c_itr++) { 
-            resample_posterior_z_for(d, c_itr->first, true);
+    _view_c_proposed.assign(FLAGS_M, 0);
+    _view_c_failed.assign(FLAGS_M, 0);
+    _view_split_merge.assign(FLAGS_M, SplitMergeStats());
+    if (FLAGS_threads > 1 && FLAGS_M > 1) {
+        // Given the feature assignments the views are independent, so sample
+        // each one on its own thread with its own random stream. All the
+        // views are joined before the next round of feature moves.
+        if (_view_random.empty()) {
+            for (int m = 0; m < FLAGS_M; m++) {
+                _view_random.push_back(new_thread_random(FLAGS_random_seed + m + 1));
+            }
+        }
+        run_parallel_tasks(FLAGS_M, resample_posterior_z_view_task, this, _view_random);
+    } else {
+        for (int d = 0; d < _DV.size(); d++) {
+            // LOG(INFO) <<  "  resampling document " <<  d;
+            // For each clustering (view), resample this document's cluster indicator
+            for (multiple_clustering::iterator c_itr = _c.begin();
+                    c_itr != _c.end();
+                    c_itr++) { 
+                resample_posterior_z_for(d, c_itr->first, true);
+            }
+        }
+        for (int m = 0; m < FLAGS_M; m++) {
+            resample_split_merge_view(m);
         }
     }
+    _c_proposed = _c_failed = 0;
+    SplitMergeStats split_merge;
+    for (int m = 0; m < FLAGS_M; m++) {
+        _c_proposed += _view_c_proposed[m];
+        _c_failed += _view_c_failed[m];
+        split_merge.add(_view_split_merge[m]);
+    }
     LOG(INFO) << _c_proposed-_c_failed << " / " << _c_proposed << " " 
         << StringPrintf("(%.3f%%)", 100 - _c_failed / (double)_c_proposed*100) << " cluster moves.";
+    if (FLAGS_split_merge_rate > 0) {
+        LOG(INFO) << split_merge.summary() << " (split-merge).";
+        for (int m = 0; m < FLAGS_M; m++) {
+            VLOG(1) << "  M[" << m << "] " << _view_split_merge[m].summary();
+        }
+    }
 
     // Write the current cluster sizes to the console
     for (multiple_clustering::iterator c_itr = _c.begin();
@@ -638,25 +892,9 @@ void CrossCatMM::resample_posterior() {
                 itr++) {
             unsigned l = itr->first;
 
-            // Compute the number of documents in this cluster with actual
-            // features in the game
-            unsigned non_zero_docs = 0;
-            for (int d = 0; d < _DD.size(); d++) {
-                for (collapsed_document::iterator d_itr = _DD[d].begin();
-                        d_itr != _DD[d].end();
-                        d_itr++) {
-                    unsigned w = d_itr->first;
-
-                    if (_m[w] == m && _z[d][m] == l) {
-                        non_zero_docs += 1;
-                        break;
-                    }
-                }
-            }
-
             // LOG(INFO) << "  C[" << l << "] (d " << itr->second.ndsum << ") " 
             //           << " " << show_chopped_sorted_nw(itr->second.nw);
-            LOG(INFO) << "  C[" << l << "] (d " << non_zero_docs << ") " 
+            LOG(INFO) << "  C[" << l << "] (d " << itr->second.nonzero_ndsum << ") " 
                       << " " << show_chopped_sorted_nw(itr->second.nw);
 
             test_sum += cm[l].ndsum;
@@ -697,7 +935,7 @@ void CrossCatMM::write_data(string prefix) {
             c_itr++) { 
         unsigned m = c_itr->first;
         clustering& cm = c_itr->second;
-        for (int d = 0; d < _DD.size(); d++) {
+        for (int d = 0; d < _DV.size(); d++) {
             f << d << "\t" << m << "\t" << _z[d][m] << endl;
         }
     }
@@ -23,6 +23,8 @@
 #include<map>
 
 #include "gibbs-base.h"
+#include "mixture-scorer.h"
+#include "split-merge.h"
 
 // the number of feature clusters
 DECLARE_int32(M);
@@ -45,22 +47,60 @@ DECLARE_double(cc_feature_move_rate);
 // If toggled, the first view will be constrained to a single cluster
 DECLARE_bool(cc_include_noise_view);
 
+// If toggled, feature moves are focused on the features whose view
+// assignment is still uncertain, instead of being spread evenly
+DECLARE_bool(cc_adaptive_feature_moves);
+
+// If toggled, each feature move is a Gibbs step over all the views instead of
+// an MH proposal to a random view
+DECLARE_bool(cc_gibbs_feature_moves);
+
 // Basically controls whether and how we should do cross-cat on the features.
 // Implemented using MH steps.
 DECLARE_string(cross_cat_prior);
 
 const string kCrossCatOff = "off";
 
-// typedef google::dense_hash_map<unsigned, unsigned> collapsed_document;
-typedef map<unsigned, unsigned> collapsed_document;
-// typedef google::dense_hash_map<unsigned, collapsed_document> collapsed_document_collection;
-typedef map<unsigned, collapsed_document> collapsed_document_collection;
+// The collapsed documents, stored flat: document d's features (sorted by id)
+// and their counts are entries [offsets[d], offsets[d+1]). Only used while
+// building the per-view documents and posting lists.
+struct collapsed_document_collection {
+    collapsed_document_collection() : offsets(1, 0) { }
+
+    vector<unsigned> offsets;
+    vector<pair<unsigned, unsigned> > entries;
+
+    unsigned size() const { return offsets.size() - 1; }
+    unsigned size(unsigned d) const { return offsets[d+1] - offsets[d]; }
+    const pair<unsigned, unsigned>& at(unsigned d, unsigned i) const {
+        return entries[offsets[d] + i];
+    }
+
+    // Collapses doc's words into counts and appends it as the next document
+    void push_back(const Document& doc);
+};
+
+// The documents containing a feature, along with the feature's count in each
+typedef vector<pair<unsigned, unsigned> > posting_list;
+
+// The part of a collapsed document that falls in a single view: its features
+// (sorted by id) with their counts, and their total count
+struct view_document {
+    view_document() : total(0) { }
+
+    vector<pair<unsigned, unsigned> > features;
+    unsigned total;
+
+    void add(unsigned w, unsigned count);
+    void remove(unsigned w);
+};
 
 // Implements several kinds of mixture models (uniform prior, Dirichlet prior,
 // DPCrossCatMM all with DP-Multinomial likelihood.
 class CrossCatMM : public GibbsSampler {
     public:
         CrossCatMM() { }
+        ~CrossCatMM();
 
         // Allocate all the documents at once (called for non-streaming)
         void batch_allocation();
@@ -71,15 +111,22 @@ class CrossCatMM : public GibbsSampler {
     protected:
         void resample_posterior();
         void resample_posterior_z_for(unsigned d, unsigned m, bool remove);
+        void resample_posterior_z_view(unsigned m);
+        static void resample_posterior_z_view_task(void* context, unsigned m);
+        void resample_split_merge_view(unsigned m);
+        void move_to_cluster(unsigned d, unsigned m, unsigned new_zdm);
         void resample_posterior_m(double percent);
-        void resample_posterior_m_for(unsigned tw);
+        bool resample_posterior_m_for(unsigned tw, double* accept_prob);
+        bool gibbs_posterior_m_for(unsigned w, double* accept_prob);
+        void choose_adaptive_features(unsigned budget, vector<unsigned>* features);
 
 
         string current_state();
 
         double compute_log_likelihood_for(unsigned m, clustering& cm);
-        double cross_cat_clustering_log_likelihood(unsigned w, unsigned m);
-        double cross_cat_reassign_features(unsigned old_m, unsigned new_m, unsigned w);
+        void feature_cluster_counts(unsigned w, unsigned m, cluster_map* counts);
+        double feature_view_log_conditional(unsigned w, unsigned m, const cluster_map& counts);
+        void cross_cat_reassign_features(unsigned old_m, unsigned new_m, unsigned w);
 
     protected:
         // Maps documents to clusters
@@ -112,14 +159,41 @@ class CrossCatMM : public GibbsSampler {
         unsigned _m_proposed;
         unsigned _m_failed;
 
+        // Mean acceptance probability of each feature's view moves (starting
+        // from one optimistic pseudo-observation); the adaptive scheduler
+        // proposes features in proportion to this, so features that are stuck
+        // in their view get fewer tries
+        vector<double> _feature_mobility;
+        vector<unsigned> _feature_proposals;
+
         // Count cluster moves
         unsigned _c_proposed;
         unsigned _c_failed;
 
-        // Data structure to hold the documents optimzed for mixture model
-        // computation (i.e. we don't need to break up each feature into
-        // occurrences, and can instead treat the count directly)
-        collapsed_document_collection _DD;
+        // Cluster moves broken down by view, so that views can be resampled
+        // concurrently (summed into _c_proposed and _c_failed)
+        vector<unsigned> _view_c_proposed;
+        vector<unsigned> _view_c_failed;
+
+        // Split-merge proposals and acceptances in each view
+        vector<SplitMergeStats> _view_split_merge;
+
+        // Each view's random stream when --threads > 1
+        vector<ThreadRandom*> _view_random;
+
+        // Each view's document scorer and its scratch space for the scores
+        vector<MixtureScorer> _view_scorer;
+        vector< vector<double> > _view_scores;
+
+        // For each feature, the documents it occurs in (so moving a feature
+        // between views only touches those documents)
+        vector<posting_list> _postings;
+
+        // The collapsed documents (i.e. we don't need to break up each
+        // feature into occurrences, and can instead treat the count directly)
+        // split up by view, [d][m]; kept in sync with _m so scoring a document
+        // in a view only touches that view's features
+        vector< vector<view_document> > _DV;
 };
 
 #endif  // SAMPLE_CROSSCAT_MM_H_
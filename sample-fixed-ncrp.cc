@@ -84,6 +84,271 @@ DEFINE_bool(sense_selection,
             false,
             "perform sense selection; needs a hierarchy with multiple attachments");
 
+// Instead of rescoring every shadow sense each iteration, propose a single
+// alternative sense per document (drawn from the attachment frequencies) and
+// accept it with a Metropolis-Hastings test.
+DEFINE_bool(sense_selection_mh,
+            false,
+            "use independence MH proposals for sense selection");
+
+// Keep a binary cache of each parsed tree structure / topic assignments file
+// next to it, so later runs over the same file skip the text parsing.
+DEFINE_bool(cache_structure_files,
+            false,
+            "cache parsed tree structure and topic assignment files in binary form");
+
+// Identifies (and versions) the structure cache format
+const uint32 kStructureCacheMagic = 0x4c565343;  // "LVSC"
+const uint32 kStructureCacheVersion = 2;
+
+// Names the structure file parsers in the cache header
+const char kTreeStructureParser[] = "tree-structure";
+
+// The cached tree is already wired, and --use_dag changes the wiring (an edge
+// either adds a parent or replaces it), so it is part of the parser id
+static string tree_structure_parser_id() {
+    return StringPrintf("%s use_dag=%d", kTreeStructureParser, FLAGS_use_dag ? 1 : 0);
+}
+
+unsigned ParsedStructureFile::index_of(const string& name) {
+    if (name_index.empty()) {
+        name_index.set_empty_key(kEmptyStringKey);
+    }
+    google::dense_hash_map<string, unsigned>::iterator itr = name_index.find(name);
+    if (itr != name_index.end()) {
+        return itr->second;
+    }
+    names.push_back(name);
+    return name_index[name] = names.size()-1;
+}
+
+// 64-bit FNV-1a over the file contents
+static uint64 hash_file_contents(const string& filename) {
+    ifstream f(filename.c_str(), ios_base::in | ios_base::binary);
+    CHECK(f.is_open()) << "couldn't open [" << filename << "]";
+
+    uint64 hash = 14695981039346656037ULL;
+    char buffer[1 << 16];
+    while (f) {
+        f.read(buffer, sizeof(buffer));
+        for (streamsize i = 0; i < f.gcount(); i++) {
+            hash ^= (unsigned char)buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+template <class T>
+static void write_binary(ostream& out, const T& x) {
+    out.write((const char*)&x, sizeof(T));
+}
+
+template <class T>
+static bool read_binary(istream& in, T* x) {
+    in.read((char*)x, sizeof(T));
+    return in.good();
+}
+
+static void write_binary_string(ostream& out, const string& s) {
+    write_binary(out, (uint32)s.size());
+    out.write(s.data(), s.size());
+}
+
+// The lengths and counts below come straight from the cache file, so they are
+// checked against its size (limit) before anything is allocated; a damaged
+// cache then just fails to load instead of asking for gigabytes.
+static bool read_binary_string(istream& in, uint64 limit, string* s) {
+    uint32 length;
+    if (!read_binary(in, &length) || length > limit) {
+        return false;
+    }
+    s->resize(length);
+    return length == 0 || in.read(&(*s)[0], length);
+}
+
+static void write_binary_indices(ostream& out, const vector<unsigned>& indices) {
+    write_binary(out, (uint32)indices.size());
+    for (int k = 0; k < indices.size(); k++) {
+        write_binary(out, (uint32)indices[k]);
+    }
+}
+
+// Fails on indices that don't refer to one of the bound names
+static bool read_binary_indices(istream& in, uint64 limit, unsigned bound,
+        vector<unsigned>* indices) {
+    uint32 count;
+    if (!read_binary(in, &count) || count > limit / sizeof(uint32)) {
+        return false;
+    }
+    indices->resize(count);
+    for (int k = 0; k < count; k++) {
+        uint32 index;
+        if (!read_binary(in, &index) || index >= bound) {
+            return false;
+        }
+        indices->at(k) = index;
+    }
+    return true;
+}
+
+void write_structure_cache(const string& filename, const string& parser_id,
+        const ParsedStructureFile& parsed) {
+    if (!FLAGS_cache_structure_files) {
+        return;
+    }
+    string cache_file = filename + ".cache";
+    ofstream out(cache_file.c_str(), ios_base::out | ios_base::binary);
+    if (!out.is_open()) {
+        LOG(WARNING) << "couldn't write structure cache [" << cache_file << "]";
+        return;
+    }
+    LOG(INFO) << "writing structure cache [" << cache_file << "]";
+    write_binary(out, kStructureCacheMagic);
+    write_binary(out, kStructureCacheVersion);
+    write_binary_string(out, parser_id);
+    write_binary(out, hash_file_contents(filename));
+
+    write_binary(out, (uint32)parsed.names.size());
+    for (int i = 0; i < parsed.names.size(); i++) {
+        write_binary_string(out, parsed.names[i]);
+    }
+    write_binary(out, (uint32)parsed.rows.size());
+    for (int i = 0; i < parsed.rows.size(); i++) {
+        write_binary_indices(out, parsed.rows[i]);
+        write_binary(out, parsed.has_weight[i]);
+        write_binary(out, parsed.weights[i]);
+    }
+
+    write_binary(out, (int32)parsed.root);
+    if (parsed.root >= 0) {
+        for (int i = 0; i < parsed.names.size(); i++) {
+            write_binary_string(out, parsed.labels[i]);
+            write_binary_indices(out, parsed.parents[i]);
+            write_binary_indices(out, parsed.children[i]);
+        }
+    }
+}
+
+// Leaves parsed in an unspecified state when returning false
+bool read_structure_cache(const string& filename, const string& parser_id,
+        ParsedStructureFile* parsed) {
+    if (!FLAGS_cache_structure_files) {
+        return false;
+    }
+    string cache_file = filename + ".cache";
+    ifstream in(cache_file.c_str(), ios_base::in | ios_base::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    in.seekg(0, ios_base::end);
+    uint64 limit = in.tellg();
+    in.seekg(0, ios_base::beg);
+
+    // (every name and row takes at least a 32-bit length)
+    uint32 magic, version, count;
+    string cached_parser_id;
+    uint64 cached_hash;
+    if (!read_binary(in, &magic) || magic != kStructureCacheMagic
+            || !read_binary(in, &version) || version != kStructureCacheVersion
+            || !read_binary_string(in, limit, &cached_parser_id) || cached_parser_id != parser_id
+            || !read_binary(in, &cached_hash) || cached_hash != hash_file_contents(filename)
+            || !read_binary(in, &count) || count > limit / sizeof(uint32)) {
+        return false;
+    }
+
+    parsed->names.resize(count);
+    for (int i = 0; i < parsed->names.size(); i++) {
+        if (!read_binary_string(in, limit, &parsed->names[i])) {
+            return false;
+        }
+    }
+
+    if (!read_binary(in, &count) || count > limit / sizeof(uint32)) {
+        return false;
+    }
+    parsed->rows.resize(count);
+    parsed->has_weight.resize(count);
+    parsed->weights.resize(count);
+    for (int i = 0; i < parsed->rows.size(); i++) {
+        if (!read_binary_indices(in, limit, parsed->names.size(), &parsed->rows[i])
+                || !read_binary(in, &parsed->has_weight[i])
+                || !read_binary(in, &parsed->weights[i])) {
+            return false;
+        }
+    }
+
+    int32 root;
+    if (!read_binary(in, &root) || root >= (int32)parsed->names.size()) {
+        return false;
+    }
+    parsed->root = root;
+    if (root >= 0) {
+        parsed->labels.resize(parsed->names.size());
+        parsed->parents.resize(parsed->names.size());
+        parsed->children.resize(parsed->names.size());
+        for (int i = 0; i < parsed->names.size(); i++) {
+            if (!read_binary_string(in, limit, &parsed->labels[i])
+                    || !read_binary_indices(in, limit, parsed->names.size(), &parsed->parents[i])
+                    || !read_binary_indices(in, limit, parsed->names.size(), &parsed->children[i])) {
+                return false;
+            }
+        }
+    }
+    LOG(INFO) << "loaded [" << filename << "] from [" << cache_file << "]";
+    return true;
+}
+
+void load_structure_file(const string& filename, const string& parser_id,
+        void (*parse)(const string&, ParsedStructureFile*),
+        ParsedStructureFile* parsed) {
+    if (read_structure_cache(filename, parser_id, parsed)) {
+        return;
+    }
+    *parsed = ParsedStructureFile();
+    parse(filename, parsed);
+    write_structure_cache(filename, parser_id, *parsed);
+}
+
+// Reads child <tab> parent [<tab> frequency] lines, normalizing the node names
+static void parse_tree_structure_file(const string& filename, ParsedStructureFile* tree) {
+    ifstream input_file(filename.c_str());
+    CHECK(input_file.is_open());
+
+    string curr_line;
+    while (true) {
+        getline(input_file, curr_line);
+
+        if (input_file.eof()) {
+            break;
+        }
+        vector<string> tokens;
+        curr_line = StringReplace(curr_line, "\n", "", true);
+        //CHECK_EQ(x, 0);
+
+        // LOG(INFO) << curr_line;
+        SplitStringUsing(curr_line, "\t", &tokens);
+
+        CHECK_GE(tokens.size(), 2);
+        CHECK_LE(tokens.size(), 3);
+
+        string source = tokens[0];
+        LowerString(&source);
+        source = StringReplace(source, "rpl_", "", false);
+
+        string dest   = tokens[1];
+        LowerString(&dest);
+        dest = StringReplace(dest, "rpl_", "", false);
+
+        vector<unsigned> row;
+        row.push_back(tree->index_of(source));
+        row.push_back(tree->index_of(dest));
+        tree->rows.push_back(row);
+        tree->has_weight.push_back(tokens.size() == 3);
+        tree->weights.push_back(tokens.size() == 3 ? strtod(tokens[2].c_str(), NULL) : 0);
+    }
+}
+
 GEMNCRPFixed::GEMNCRPFixed(double m,
         double pi)
 : _gem_m(m), _pi(pi), _maxL(0) {
@@ -92,6 +357,11 @@ GEMNCRPFixed::GEMNCRPFixed(double m,
 
     CHECK_GE(_gem_m, 0.0);
     CHECK_LE(_gem_m, 1.0);
+
+    _doc_histogram.set_empty_key(kEmptyUnsignedKey);
+    _word_count_histogram.set_empty_key(kEmptyUnsignedKey);
+    _eta_nodes = 0;
+    _eta_histograms_built = false;
 }
 
 
@@ -110,7 +380,7 @@ string GEMNCRPFixed::current_state() {
                 _eta_sum / (double)_eta.size(),
                 FLAGS_ncrp_z_per_iteration);
         return StringPrintf("ll = %f (%f at %d) (%d nodes) m = %f pi = %f eta = %f L = %d",
-                _ll, _best_ll, _best_iter, _unique_nodes, _gem_m, _pi,
+                _ll, _best_ll, _best_iter, _stats.nodes, _gem_m, _pi,
                 _eta_sum / (double)_eta.size(), _maxL);
     } else {
         _filename += StringPrintf("-L%d-alpha%f-eta%f-zpi%d", _maxL,
@@ -118,13 +388,14 @@ string GEMNCRPFixed::current_state() {
                 _eta_sum / (double)_eta.size(),
                 FLAGS_ncrp_z_per_iteration);
         return StringPrintf("ll = %f (%f at %d) (%d nodes) alpha = %f eta = %f L = %d",
-                _ll, _best_ll, _best_iter, _unique_nodes,
+                _ll, _best_ll, _best_iter, _stats.nodes,
                 _alpha_sum / (double)_alpha.size(),
                 _eta_sum / (double)_eta.size(), _maxL);
     }
 }
 
 void GEMNCRPFixed::load_precomputed_tree_structure(const string& filename) {
+    _stats = TreeStats();  // the file replaces the constructor's initial chain
     google::dense_hash_map<string, CRP*> node_to_crp;
     node_to_crp.set_empty_key(kEmptyStringKey);
 
@@ -171,6 +442,7 @@ void GEMNCRPFixed::load_precomputed_tree_structure(const string& filename) {
                     node_to_crp[tokens[i]]->label = tokens[i];
                     CHECK_EQ(node_to_crp[tokens[i]]->prev.size(), 0);
                     LOG(INFO) << "creating node [" << tokens[i] << "]";
+                    _stats.add_node(0);
                 }
             }
             // Build the _c vector
@@ -290,101 +562,142 @@ void GEMNCRPFixed::load_tree_structure(const string& filename) {
     CHECK(!(FLAGS_separate_path_assignments && FLAGS_sense_selection));
     CHECK(!(!FLAGS_use_dag && FLAGS_sense_selection));
 
-    ifstream input_file(filename.c_str());
-    CHECK(input_file.is_open());
+    // A cached tree comes with its graph already wired and contracted
+    ParsedStructureFile tree;
+    bool resolved = read_structure_cache(filename, tree_structure_parser_id(), &tree)
+        && tree.root >= 0;
+    if (!resolved) {
+        tree = ParsedStructureFile();
+        parse_tree_structure_file(filename, &tree);
+    }
 
-    // First pass over the entire tree structure and create CRP nodes for each
-    // of the unique node names
-    string curr_line;
-    while (true) {
-        getline(input_file, curr_line);
+    // Create CRP nodes for each of the unique node names (in the order they
+    // first appear in the file)
+    vector<CRP*> nodes(tree.names.size());
+    for (int i = 0; i < tree.names.size(); i++) {
+        nodes[i] = new CRP(0, 0);
+        nodes[i]->label = tree.names[i];
+        node_to_crp[tree.names[i]] = nodes[i];
+    }
 
-        if (input_file.eof()) {
-            break;
+    if (resolved) {
+        for (int i = 0; i < nodes.size(); i++) {
+            nodes[i]->label = tree.labels[i];
+            for (int k = 0; k < tree.parents[i].size(); k++) {
+                nodes[i]->prev.push_back(nodes[tree.parents[i][k]]);
+            }
+            for (int k = 0; k < tree.children[i].size(); k++) {
+                nodes[i]->tables.push_back(nodes[tree.children[i][k]]);
+            }
+        }
+        _ncrp_root = nodes[tree.root];
+    } else {
+        map<CRP*, unsigned> node_index;
+        for (int i = 0; i < nodes.size(); i++) {
+            node_index[nodes[i]] = i;
         }
-        vector<string> tokens;
-        curr_line = StringReplace(curr_line, "\n", "", true);
-        //CHECK_EQ(x, 0);
-
-        // LOG(INFO) << curr_line;
-        SplitStringUsing(curr_line, "\t", &tokens);
-
-        CHECK_GE(tokens.size(), 2);
-        CHECK_LE(tokens.size(), 3);
-
-        string source = tokens[0];
-        LowerString(&source);
-        source = StringReplace(source, "rpl_", "", false);
 
-        string dest   = tokens[1];
-        LowerString(&dest);
-        dest = StringReplace(dest, "rpl_", "", false);
+        // Now wire up the edges
+        set<pair<unsigned, unsigned> > edges;  // (source, dest) currently wired
+        for (int i = 0; i < tree.rows.size(); i++) {
+            unsigned source_index = tree.rows[i][0];
+            unsigned dest_index = tree.rows[i][1];
+            const string& source = tree.names[source_index];
+            const string& dest = tree.names[dest_index];
+            CRP* source_node = nodes[source_index];
+            CRP* dest_node = nodes[dest_index];
+
+            // Set up the pointers correctly so that the tree/dag gets built
+            if (source_node->prev.size() > 0 && !FLAGS_use_dag) {
+                // overwrite the existing connection
+                LOG(INFO) << "overwriting [" << source << "] -> ["
+                    << source_node->prev[0]->label << "]";
+                // Delete ourselves from our parent
+                source_node->remove_from_parents();
+                for (int k = 0; k < source_node->prev.size(); k++) {
+                    edges.erase(make_pair(source_index, node_index[source_node->prev[k]]));
+                }
+                source_node->prev[0] = dest_node;
+            } else {
+                source_node->prev.push_back(dest_node);
+            }
 
+            // Make sure this edge isn't already there
+            CHECK(edges.insert(make_pair(source_index, dest_index)).second)
+                << "duplicate edge [" << source << "] -> [" << dest << "]";
 
-        if (node_to_crp.find(source) == node_to_crp.end()) {
-            // havent made a CRP node for this yet
-            node_to_crp[source] = new CRP(0, 0);
-            node_to_crp[source]->label = source;
-            CHECK_EQ(node_to_crp[source]->prev.size(), 0);
-        }
-        if (node_to_crp.find(dest) == node_to_crp.end()) {
-            // havent made a CRP node for this yet
-            node_to_crp[dest] = new CRP(0, 0);
-            node_to_crp[dest]->label = dest;
-            CHECK_EQ(node_to_crp[dest]->prev.size(), 0);
+            dest_node->tables.push_back(source_node);
+            VLOG(1) << "connecting [" << source << "] -> [" << dest << "]";
         }
 
-        // Set up the pointers correctly so that the tree/dag gets built
-        if (node_to_crp[source]->prev.size() > 0 && !FLAGS_use_dag) {
-            // overwrite the existing connection
-            LOG(INFO) << "overwriting [" << source << "] -> ["
-                << node_to_crp[source]->prev[0]->label << "]";
-            // Delete ourselves from our parent
-            node_to_crp[source]->remove_from_parents();
-            node_to_crp[source]->prev[0] = node_to_crp[dest];
-        } else {
-            node_to_crp[source]->prev.push_back(node_to_crp[dest]);
+        // NOTE: this won't work as well in the DAG case
+        // HACK to find the root
+        VLOG(1) << "finding root...";
+        _ncrp_root = node_to_crp.begin()->second;
+        while (_ncrp_root->prev.size() > 0) {
+            CHECK(_ncrp_root);
+            CHECK(_ncrp_root->prev[0]);
+            _ncrp_root = _ncrp_root->prev[0];
+            LOG(INFO) << _ncrp_root->label;
         }
 
-        // Make sure this edge isn't already there
-        CHECK(find(node_to_crp[dest]->tables.begin(),
-                    node_to_crp[dest]->tables.end(),
-                    node_to_crp[source]) == node_to_crp[dest]->tables.end());
-
-        node_to_crp[dest]->tables.push_back(node_to_crp[source]);
-        VLOG(1) << "connecting [" << source << "] -> [" << dest << "]";
+        // Now remove "excess" nodes in the form of chains and trim off nodes with
+        // no non-wn children
+        // NOTE: this has to come before the _c assignments are made
+        contract_tree();
+
+        // Record the contracted graph for the cache
+        tree.labels.resize(nodes.size());
+        tree.parents.resize(nodes.size());
+        tree.children.resize(nodes.size());
+        for (int i = 0; i < nodes.size(); i++) {
+            tree.labels[i] = nodes[i]->label;
+            for (int k = 0; k < nodes[i]->prev.size(); k++) {
+                tree.parents[i].push_back(node_index[nodes[i]->prev[k]]);
+            }
+            for (int k = 0; k < nodes[i]->tables.size(); k++) {
+                tree.children[i].push_back(node_index[nodes[i]->tables[k]]);
+            }
+        }
+        tree.root = node_index[_ncrp_root];
+        write_structure_cache(filename, tree_structure_parser_id(), tree);
+    }
 
-        // Set up the node frequency info if necessary
-        if (tokens.size() == 3) {
+    // Set up the node frequency info if necessary
+    for (int i = 0; i < tree.rows.size(); i++) {
+        if (tree.has_weight[i]) {
             CHECK(FLAGS_sense_selection); // Only sense selection can handle extra
             // input
             // Make sure that this is really a flat class
+            const string& source = tree.names[tree.rows[i][0]];
             CHECK(_document_id.find(source) != _document_id.end());
 
-            double freq = strtod(tokens[2].c_str(), NULL);
-            _log_node_freq[_document_id[source]][node_to_crp[dest]] = log(freq);
+            double freq = tree.weights[i];
+            _log_node_freq[_document_id[source]][nodes[tree.rows[i][1]]] = log(freq);
         }
     }
 
-    // NOTE: this won't work as well in the DAG case
-    // HACK to find the root
-    VLOG(1) << "finding root...";
-    _ncrp_root = node_to_crp.begin()->second;
-    while (_ncrp_root->prev.size() > 0) {
-        CHECK(_ncrp_root);
-        CHECK(_ncrp_root->prev[0]);
-        _ncrp_root = _ncrp_root->prev[0];
-        LOG(INFO) << _ncrp_root->label;
+    // The tree replaces the constructor's initial chain; only the nodes left
+    // after contraction count. Levels aren't fixed in the DAG, so like the
+    // precomputed topics these are all tracked at level 0.
+    _stats = TreeStats();
+    deque<CRP*> node_queue;
+    set<CRP*> counted;
+    node_queue.push_back(_ncrp_root);
+    while (!node_queue.empty()) {
+        CRP* current = node_queue.front();
+        node_queue.pop_front();
+        if (counted.insert(current).second) {
+            _stats.add_node(0);
+            node_queue.insert(node_queue.end(), current->tables.begin(),
+                    current->tables.end());
+        }
     }
 
-    // Now remove "excess" nodes in the form of chains and trim off nodes with
-    // no non-wn children
-    // NOTE: this has to come before the _c assignments are made
-    contract_tree();
-
     if (FLAGS_use_reject_option) {
         _reject_node = new CRP(0,0); // add a REJECT topic
         _reject_node->label = "REJECT";
+        _stats.add_node(0);
     }
 
     _total_words = 0;
@@ -597,17 +910,24 @@ void GEMNCRPFixed::build_path_assignments(CRP* node, vector<CRP*>* c, int sense_
     VLOG(1) << "[" << sense_index << "] " << node->label << ":";
 
     // Perform a level-by-level traversal up the tree, building
-    // the vector of assignments
+    // the vector of assignments. Ancestors shared by several parents are only
+    // expanded the first time they are reached; later visits can't add
+    // anything new.
+    set<CRP*> in_path(c->begin(), c->end());
+    set<CRP*> expanded;
     deque<CRP*> node_queue;
     node_queue.push_back(node);
     while (!node_queue.empty()) {
         CRP* current = node_queue.front();
         node_queue.pop_front();
+        if (!expanded.insert(current).second) {
+            continue;
+        }
         // First check to see if we should remove the non WN concept nodes from
         // the list of topics
         if (!FLAGS_fold_non_wn || current->label.find("wn_") == 0) {
             // If this node is not yet in d's set of parents
-            if (find(c->begin(), c->end(), current) == c->end()) {
+            if (in_path.insert(current).second) {
                 c->insert(c->begin(), current);
                 VLOG(1) << "  [" << current->label << "]";
             }
@@ -782,13 +1102,17 @@ void GEMNCRPFixed::contract_tree() {
 void GEMNCRPFixed::resample_posterior_z_for(unsigned d, vector<CRP*>& cd, WordToCountMap& zd) {
     // CHECK_EQ(_L, -1);  // HACK to make sure we're not using _L
 
+    if (!FLAGS_gem_sampler) {
+        resample_posterior_z_multinomial_for(d, cd, zd);
+        return;
+    }
+
     for (int n = 0; n < _D[d].size(); n++) {  // loop over every word
         unsigned w = _D[d][n];
         // Compute the new level assignment #
         // #################################### Remove this word from the counts
-        cd[zd[n]]->nw[w] -= 1;  // number of words in topic z equal to w
+        change_word_count(cd[zd[n]], w, -1);  // number of words in topic z (equal to w)
         cd[zd[n]]->nd[d] -= 1;  // number of words in doc d with topic z
-        cd[zd[n]]->nwsum -= 1;  // number of words in topic z
         _nd[d] -= 1;  // number of words in doc d
 
         CHECK_GE(cd[zd[n]]->nwsum, 0);
@@ -797,89 +1121,48 @@ void GEMNCRPFixed::resample_posterior_z_for(unsigned d, vector<CRP*>& cd, WordTo
         CHECK_GT(cd[zd[n]]->ndsum, 0);
 
         vector<double> lposterior_z_dn;
-        if (FLAGS_gem_sampler) {
-            CHECK(!FLAGS_use_reject_option)
-                << "Reject option not implemented with gem_sampler";
-            CHECK(false) << "GEM sampler might not work new eta,alpha changes FIXL2";
-            // ndsum_above[k] is #[z_{d,-n} >= k]
-            vector<unsigned> ndsum_above;
-            ndsum_above.resize(cd.size());
-            ndsum_above[cd.size()-1] = cd.back()->nd[d];
-            // LOG(INFO) << "ndsum_above[" << cd.size()-1 << "] = "
-            //           << ndsum_above.back();
-            for (int l = cd.size()-2; l >= 0; l--) {
-                // TODO: optimize this
-                ndsum_above[l] = cd[l]->nd[d] + ndsum_above[l+1];
-                // LOG(INFO) << "ndsum_above[" << l << "] = " << ndsum_above[l];
-            }
+        CHECK(!FLAGS_use_reject_option)
+            << "Reject option not implemented with gem_sampler";
+        CHECK(false) << "GEM sampler might not work new eta,alpha changes FIXL2";
+        // ndsum_above[k] is #[z_{d,-n} >= k]
+        vector<unsigned> ndsum_above;
+        ndsum_above.resize(cd.size());
+        ndsum_above[cd.size()-1] = cd.back()->nd[d];
+        // LOG(INFO) << "ndsum_above[" << cd.size()-1 << "] = "
+        //           << ndsum_above.back();
+        for (int l = cd.size()-2; l >= 0; l--) {
+            // TODO: optimize this
+            ndsum_above[l] = cd[l]->nd[d] + ndsum_above[l+1];
+            // LOG(INFO) << "ndsum_above[" << l << "] = " << ndsum_above[l];
+        }
 
-            // Here we assign probabilities to all the "finite" options, e.g. all
-            // the levels up to the current maximum level for this document. TODO:
-            // this can be optimized quite extensively
-            double V_j_sum = 0;
-            unsigned total_nd = 0;
-            for (int l = 0; l < cd.size(); l++) {
-                // check that ["doesnt exist"]->0
-                //DCHECK(cd[l]->nw.find(w) != cd[l]->nw.end() || cd[l]->nw[w] == 0);
-                //DCHECK(cd[l]->nd.find(d) != cd[l]->nd.end() || cd[l]->nd[d] == 0);
-                total_nd += cd[l]->nd[d];
-
-                double lp_w_dn = log(_eta[w] + cd[l]->nw[w]) -
-                    log(_eta_sum + cd[l]->nwsum);
-                double lp_z_dn = log(_pi*(1-_gem_m) + cd[l]->nd[d]) -
-                    log(_pi + ndsum_above[l]) + V_j_sum;
-
-                lposterior_z_dn.push_back(lp_w_dn + lp_z_dn);
-                // LOG(INFO) << l << " " << lp_w_dn << " + " << lp_z_dn
-                //           << " = " << lposterior_z_dn[l];
-                // LOG(INFO) << "  " << V_j_sum;
-
-                if (l < cd.size()-1) {
-                    V_j_sum += log(_gem_m*_pi + ndsum_above[l+1]) -
-                        log(_pi + ndsum_above[l]);
-                }
-            }
-            //DCHECK_EQ(total_nd, _nd[d]);
-        } else {  // multinomial sampler
-            double alpha_sum_c_d = 0;
-            for (int l = 0; l < cd.size(); l++) {
-                //LOG(INFO) << "jj" << n << l;
-                alpha_sum_c_d += _alpha.at(l);
-            }
-            for (int l = 0; l < cd.size(); l++) {
-                if (FLAGS_use_reject_option && cd[l]->label.find("REJECT") == 0) {
-                    // This version puts a uniform distribution over the vocabulary in
-                    // the reject node, but allows each document to choose its "affinity"
-                    // for putting things there
-
-                    // XXX: THis is the original version with _L wrong
-                    // lposterior_z_dn.push_back(-log(_lV) +
-                    //                           log(_alpha + cd[l]->nd[d]) -
-                    //                           log(_L*_alpha + _nd[d]));
-
-
-                    // This version is uniform over the vocab
-                    lposterior_z_dn.push_back(-log(_lV) +
-                            log(_alpha.at(l) + cd[l]->nd[d]) -
-                            log(alpha_sum_c_d + _nd[d]));
-
-                    // Uniform over the document's vocab
-                    // lposterior_z_dn.push_back(-log(_D[d].size()) +
-                    //                           log(norm_alpha + cd[l]->nd[d]) -
-                    //                           log(_alpha + _nd[d]));
-                } else {
-                    // XXX: THis is the original version with _L wrong
-                    // lposterior_z_dn.push_back(log(_eta + cd[l]->nw[w]) -
-                    //                           log(_eta_sum + cd[l]->nwsum) +
-                    //                           log(_alpha + cd[l]->nd[d]) -
-                    //                           log(_L*_alpha + _nd[d]));
-                    lposterior_z_dn.push_back(log(_eta.at(w) + cd.at(l)->nw[w]) -
-                            log(_eta_sum + cd.at(l)->nwsum) +
-                            log(_alpha.at(l) + cd[l]->nd[d]) -
-                            log(alpha_sum_c_d + _nd[d]));
-                }
+        // Here we assign probabilities to all the "finite" options, e.g. all
+        // the levels up to the current maximum level for this document. TODO:
+        // this can be optimized quite extensively
+        double V_j_sum = 0;
+        unsigned total_nd = 0;
+        for (int l = 0; l < cd.size(); l++) {
+            // check that ["doesnt exist"]->0
+            //DCHECK(cd[l]->nw.find(w) != cd[l]->nw.end() || cd[l]->nw[w] == 0);
+            //DCHECK(cd[l]->nd.find(d) != cd[l]->nd.end() || cd[l]->nd[d] == 0);
+            total_nd += cd[l]->nd[d];
+
+            double lp_w_dn = log(_eta[w] + cd[l]->nw[w]) -
+                log(_eta_sum + cd[l]->nwsum);
+            double lp_z_dn = log(_pi*(1-_gem_m) + cd[l]->nd[d]) -
+                log(_pi + ndsum_above[l]) + V_j_sum;
+
+            lposterior_z_dn.push_back(lp_w_dn + lp_z_dn);
+            // LOG(INFO) << l << " " << lp_w_dn << " + " << lp_z_dn
+            //           << " = " << lposterior_z_dn[l];
+            // LOG(INFO) << "  " << V_j_sum;
+
+            if (l < cd.size()-1) {
+                V_j_sum += log(_gem_m*_pi + ndsum_above[l+1]) -
+                    log(_pi + ndsum_above[l]);
             }
         }
+        //DCHECK_EQ(total_nd, _nd[d]);
 
         // Update the assignment
         zd[n] = sample_unnormalized_log_multinomial(&lposterior_z_dn);
@@ -893,15 +1176,98 @@ void GEMNCRPFixed::resample_posterior_z_for(unsigned d, vector<CRP*>& cd, WordTo
         // DCHECK(cd[zd[n]]->nw.find(w) != cd[zd[n]]->nw.end() || cd[zd[n]]->nw[w] == 0);
         // DCHECK(cd[zd[n]]->nd.find(d) != cd[zd[n]]->nd.end() || cd[zd[n]]->nd[d] == 0);
 
-        cd[zd[n]]->nw[w] += 1;  // number of words in topic z equal to w
+        change_word_count(cd[zd[n]], w, 1);  // number of words in topic z (equal to w)
         cd[zd[n]]->nd[d] += 1;  // number of words in doc d with topic z
-        cd[zd[n]]->nwsum += 1;  // number of words in topic z
         _nd[d]              += 1;  // number of words in doc d
 
         CHECK_GT(cd[zd[n]]->ndsum, 0);
     }
 }
 
+// Multinomial level sampler. The alpha normalizer, the reject levels and the
+// log terms that only change when a level's counts change are worked out once
+// per document visit (in _level_context) instead of once per token and level.
+void GEMNCRPFixed::resample_posterior_z_multinomial_for(unsigned d, vector<CRP*>& cd, WordToCountMap& zd) {
+    unsigned L = cd.size();
+    const Document& words = _D[d];
+    LevelScoringContext& ctx = _level_context;
+    begin_level_context(d, cd, &ctx);
+
+    for (int n = 0; n < words.size(); n++) {  // loop over every word
+        unsigned w = words[n];
+        unsigned z = zd[n];
+
+        // Remove this word from the counts
+        change_word_count(cd[z], w, -1);  // number of words in topic z (equal to w)
+        ctx.nd[z] -= 1;
+        update_level_context(z, cd[z]->nwsum, &ctx);
+
+        for (int l = 0; l < L; l++) {
+            WordToCountMap::const_iterator itr = cd[l]->nw.find(w);
+            ctx.nw[l] = (itr == cd[l]->nw.end()) ? 0 : itr->second;
+        }
+        score_levels(w, &ctx);
+
+        // Update the assignment
+        z = sample_unnormalized_log_multinomial(&ctx.scores[0], L);
+        CHECK_LT(z, L);
+        zd[n] = z;
+
+        // Update the counts
+        change_word_count(cd[z], w, 1);  // number of words in topic z (equal to w)
+        ctx.nd[z] += 1;
+        update_level_context(z, cd[z]->nwsum, &ctx);
+    }
+
+    // Write back the per-document level counts
+    for (int l = 0; l < L; l++) {
+        cd[l]->nd[d] = ctx.nd[l];
+    }
+}
+
+void GEMNCRPFixed::begin_level_context(unsigned d, const vector<CRP*>& cd,
+        LevelScoringContext* ctx) const {
+    unsigned L = cd.size();
+    ctx->reject.resize(L);
+    ctx->nd.resize(L);
+    ctx->log_alpha_nd.resize(L);
+    ctx->log_eta_nwsum.resize(L);
+    ctx->nw.resize(L);
+    ctx->scores.resize(L);
+
+    double alpha_sum_c_d = 0;
+    for (int l = 0; l < L; l++) {
+        CHECK_GT(cd[l]->ndsum, 0);
+        alpha_sum_c_d += _alpha.at(l);
+        ctx->reject[l] = FLAGS_use_reject_option && cd[l]->label.find("REJECT") == 0;
+        DocToWordCountMap::const_iterator nd_itr = cd[l]->nd.find(d);
+        ctx->nd[l] = (nd_itr == cd[l]->nd.end()) ? 0 : nd_itr->second;
+        update_level_context(l, cd[l]->nwsum, ctx);
+    }
+    // Removing a word always leaves _nd[d]-1 words behind
+    ctx->log_norm = log(alpha_sum_c_d + _nd.find(d)->second - 1);
+    ctx->log_uniform_word = -log(_lV);
+}
+
+void GEMNCRPFixed::score_levels(unsigned w, LevelScoringContext* ctx) const {
+    double eta_w = _eta.at(w);
+    for (int l = 0; l < ctx->scores.size(); l++) {
+        if (ctx->reject[l]) {
+            // This version puts a uniform distribution over the vocabulary
+            // in the reject node, but allows each document to choose its
+            // "affinity" for putting things there
+            ctx->scores[l] = ctx->log_uniform_word +
+                ctx->log_alpha_nd[l] -
+                ctx->log_norm;
+        } else {
+            ctx->scores[l] = log(eta_w + ctx->nw[l]) -
+                ctx->log_eta_nwsum[l] +
+                ctx->log_alpha_nd[l] -
+                ctx->log_norm;
+        }
+    }
+}
+
 // When doing sense selection, we need to choose between possible alternative
 // document->WN attachments. The way to do this is to keep multiple copies of
 // te same document with "shadow" level assignments. When we resample the sense
@@ -915,6 +1281,11 @@ void GEMNCRPFixed::resample_posterior_c_for(unsigned d) {
     CHECK(!FLAGS_separate_path_assignments)
         << "Can't use separate path assignments when learning sense";
 
+    if (FLAGS_sense_selection_mh) {
+        resample_posterior_c_for_mh(d);
+        return;
+    }
+
     // First compute the probability for the original non-shadow document
     double lf = _log_node_freq[d][_c[d].back()];
     lp_c_d.push_back(compute_path_probability_for(d,_c[d])+lf);
@@ -943,14 +1314,7 @@ void GEMNCRPFixed::resample_posterior_c_for(unsigned d) {
     if (index > 0) {
         //VLOG(1) << "swapping [" << _document_name[d] << "] from "
         //        << _c[d].back()->label << " to " << _c_shadow[d][index-1].back()->label;
-        // Swap the old _z[d] with the shadow
-
-        WordToCountMap temp = _z_shadow[d][index-1];
-        vector<CRP*> temp_topics = _c_shadow[d][index-1];
-        _z_shadow[d][index-1] = _z[d];
-        _z[d] = temp;
-        _c_shadow[d][index-1] = _c[d];
-        _c[d] = temp_topics;
+        swap_in_shadow_sense(d, index-1);
     } else {
         //VLOG(1) << "not swaping [" << _document_name[d] <<"]";
     }
@@ -958,15 +1322,61 @@ void GEMNCRPFixed::resample_posterior_c_for(unsigned d) {
     add_all_words_from(d, _c[d], _z[d]);
 }
 
+// Independence MH version of sense selection. The proposal draws a sense s
+// with probability proportional to its attachment frequency, so q(s) cancels
+// the frequency term of the target and the acceptance ratio reduces to the
+// ratio of the path probabilities. Only the current sense and the proposed
+// one get scored, regardless of how many senses the document has.
+void GEMNCRPFixed::resample_posterior_c_for_mh(unsigned d) {
+    unsigned senses = _z_shadow[d].size();
+    if (senses == 0) {
+        return;
+    }
+
+    // Draw the proposal; index 0 is the current sense
+    vector<double> lf(senses+1);
+    lf[0] = _log_node_freq[d][_c[d].back()];
+    for (int s = 0; s < senses; s++) {
+        lf[s+1] = _log_node_freq[d][_c_shadow[d][s].back()];
+        CHECK_LE(lf[s+1],0);  // make sure lf is a valid probability
+    }
+    unsigned proposal = sample_unnormalized_log_multinomial(&lf);
+    if (proposal == 0) {
+        return;
+    }
+    unsigned s = proposal-1;
+
+    double lp_current = compute_path_probability_for(d,_c[d]);
+
+    remove_all_words_from(d, _c[d], _z[d]);
+
+    add_all_words_from(d, _c_shadow[d][s], _z_shadow[d][s]);
+    resample_posterior_z_for(d, _c_shadow[d][s], _z_shadow[d][s]); // update the z assignments to be fair
+    double lp_proposal = compute_path_probability_for(d,_c_shadow[d][s]);
+    remove_all_words_from(d, _c_shadow[d][s], _z_shadow[d][s]);
+
+    if (log(sample_uniform()) < lp_proposal - lp_current) {
+        swap_in_shadow_sense(d, s);
+    }
+
+    add_all_words_from(d, _c[d], _z[d]);
+}
+
+// Exchanges the active level assignments and path of d with shadow sense s.
+// The containers swap their contents rather than being copied.
+void GEMNCRPFixed::swap_in_shadow_sense(unsigned d, unsigned s) {
+    _z[d].swap(_z_shadow[d][s]);
+    _c[d].swap(_c_shadow[d][s]);
+}
+
 // Assume that all the words for document d have been assigned using the level
 // assignment zd, now remove them all.
 void GEMNCRPFixed::remove_all_words_from(unsigned d, vector<CRP*>& cd, WordToCountMap& zd) {
     // Remove this document's words from the relevant counts
     for (int n = 0; n < _D[d].size(); n++) {
         unsigned w = _D[d][n];
-        cd[zd[n]]->nw[w] -= 1;  // # of words in topic z equal to w
+        change_word_count(cd[zd[n]], w, -1);  // # of words in topic z (equal to w)
         cd[zd[n]]->nd[d] -= 1;  // # of words in doc d with topic z
-        cd[zd[n]]->nwsum -= 1;  // # of words in topic z
 
         CHECK_LE(cd[zd[n]]->nw[w], _total_word_count);
         CHECK_LE(cd[zd[n]]->nwsum, _total_word_count);
@@ -979,9 +1389,8 @@ void GEMNCRPFixed::add_all_words_from(unsigned d, vector<CRP*>& cd, WordToCountM
     // Remove this document's words from the relevant counts
     for (int n = 0; n < _D[d].size(); n++) {
         unsigned w = _D[d][n];
-        cd[zd[n]]->nw[w] += 1;  // # of words in topic z equal to w
+        change_word_count(cd[zd[n]], w, 1);  // # of words in topic z (equal to w)
         cd[zd[n]]->nd[d] += 1;  // # of words in doc d with topic z
-        cd[zd[n]]->nwsum += 1;  // # of words in topic z
 
         CHECK_LE(cd[zd[n]]->nw[w], _total_word_count);
         CHECK_LE(cd[zd[n]]->nwsum, _total_word_count);
@@ -989,98 +1398,185 @@ void GEMNCRPFixed::add_all_words_from(unsigned d, vector<CRP*>& cd, WordToCountM
 }
 
 // Returns the (unnormalized) path probability for document d given the current
-// set of _z assignments
+// set of _z assignments. Repeated tokens contribute identical terms, so each
+// distinct word is scored once and weighted by its count, and the per-level
+// normalizer is taken once for all the tokens.
 double GEMNCRPFixed::compute_path_probability_for(unsigned d, vector<CRP*>& cd) {
+    const WordHistogram& h = doc_histogram_for(d);
     double lp_c_d = 0;
 
     for (unsigned l = 0; l < cd.size(); l++) {
-        for (int k = 0; k < _D[d].size(); k++) {
-            unsigned w = _D[d][k];
-            lp_c_d += gammaln(cd[l]->nw[w] + _eta[w])
-                - gammaln(cd[l]->nwsum + _eta_sum);
+        const WordToCountMap& nw = cd[l]->nw;
+        for (int i = 0; i < h.words.size(); i++) {
+            unsigned w = h.words[i];
+            WordToCountMap::const_iterator itr = nw.find(w);
+            unsigned count = (itr == nw.end()) ? 0 : itr->second;
+            lp_c_d += h.counts[i] * gammaln(count + _eta[w]);
         }
+        lp_c_d -= h.total * gammaln(cd[l]->nwsum + _eta_sum);
     }
 
     return lp_c_d;
 }
 
+const WordHistogram& GEMNCRPFixed::doc_histogram_for(unsigned d) {
+    google::dense_hash_map<unsigned, WordHistogram>::iterator itr = _doc_histogram.find(d);
+    if (itr != _doc_histogram.end()) {
+        return itr->second;
+    }
+
+    WordHistogram& h = _doc_histogram[d];
+    build_word_histogram(_D[d], &h);
+    return h;
+}
+
 
 
 // If we're doing hyperparameter updates, then sample eta using Metropolis
-// Hastings steps
+// Hastings steps. Each proposal only perturbs a handful of dimensions, so the
+// acceptance ratio is computed as a difference over just those words (using
+// the per-word count histograms) plus the change in the normalizers.
 void GEMNCRPFixed::resample_posterior_eta() {
-    vector<double> new_eta;
-    double new_eta_sum = 0;
-
-    // Set up the new proposal and calculate B^{-K}(\beta) for both the new
-    // distribution and the old one
-    double lp_eta = 0;
-    double lp_new_eta = 0;
-    for (int v = 0; v < _eta.size(); v++) {
-        //LOG(INFO) << _eta[v] << " + " << sample_gaussian();
-        if (sample_uniform() < 0.005) {
-            new_eta.push_back(max(0.0001, _eta[v] + sample_gaussian() / 10.0));
-        } else {
-            new_eta.push_back(_eta[v]);
+    const double kPerturbRate = 0.005;
+
+    if (!_eta_histograms_built) {
+        build_eta_count_histograms();
+    }
+
+    // Choose the perturbed dimensions by skipping ahead geometrically rather
+    // than flipping a coin for every word in the vocabulary
+    vector<unsigned> changed;
+    vector<double> changed_eta;
+    double new_eta_sum = _eta_sum;
+    double log_stay = log(1.0 - kPerturbRate);
+    double v = floor(log(sample_uniform()) / log_stay);
+    while (v < _eta.size()) {
+        unsigned w = (unsigned)v;
+        changed.push_back(w);
+        changed_eta.push_back(max(0.0001, _eta[w] + sample_gaussian() / 10.0));
+        new_eta_sum += changed_eta.back() - _eta[w];
+        v += 1 + floor(log(sample_uniform()) / log_stay);
+    }
+
+    if (changed.empty()) {
+        return;
+    }
+
+    // The Gamma(eta_sum) part of B^{-1}(\beta), in every topic
+    double lp_delta = _eta_nodes * (gammaln(new_eta_sum) - gammaln(_eta_sum));
+
+    // The word counts in each topic. Each changed word contributes
+    // Gamma(eta_w + count) / Gamma(eta_w) in every topic, which is 1 in the
+    // topics that don't have the word, so only the nonzero counts matter.
+    for (int i = 0; i < changed.size(); i++) {
+        unsigned w = changed[i];
+        google::dense_hash_map<unsigned, WordToCountMap>::const_iterator h_itr
+            = _word_count_histogram.find(w);
+        if (h_itr == _word_count_histogram.end()) {
+            continue;
+        }
+        double new_eta = changed_eta[i];
+        double old_eta = _eta[w];
+        for (WordToCountMap::const_iterator itr = h_itr->second.begin();
+                itr != h_itr->second.end();
+                itr++) {
+            unsigned count = itr->first;
+            unsigned nodes = itr->second;
+            lp_delta += nodes * (gammaln(new_eta + count) - gammaln(new_eta)
+                    - gammaln(old_eta + count) + gammaln(old_eta));
         }
-        new_eta_sum += new_eta[v];
+    }
 
-        lp_eta -= gammaln(_eta[v]);
-        lp_new_eta -= gammaln(new_eta[v]);
+    // The topic normalizers
+    for (WordToCountMap::const_iterator itr = _nwsum_histogram.begin();
+            itr != _nwsum_histogram.end();
+            itr++) {
+        unsigned nwsum = itr->first;
+        unsigned nodes = itr->second;
+        lp_delta -= nodes * (gammaln(nwsum + new_eta_sum)
+                - gammaln(nwsum + _eta_sum));
     }
 
-    lp_eta += gammaln(_eta_sum);
-    lp_new_eta += gammaln(new_eta_sum);
+    // Add in the prior (for now this is uniform)
+    // XXX
+
+    // Now check to see if we should MH step
+    double k = log(sample_uniform());
 
-    double lp_eta2 = 0;
-    double lp_new_eta2 = 0;
+    VLOG(1) << "X " << changed.size() << " changed = " << lp_delta << " " << new_eta_sum / (double)_eta.size();
+    if (k < lp_delta) {
+        VLOG(1) << "RESAMPLED";
+        for (int i = 0; i < changed.size(); i++) {
+            _eta[changed[i]] = changed_eta[i];
+        }
+        _eta_sum = new_eta_sum;
+    }
+}
 
-    // Multiply probabilities over all the topics
+void GEMNCRPFixed::build_eta_count_histograms() {
+    _word_count_histogram.clear();
+    _nwsum_histogram.clear();
+    _eta_nodes = 0;
+
+    // Every node that can hold words: the DAG, the REJECT node, and (to be
+    // safe) every node on some document's path. The tree doesn't change
+    // shape after loading, so this set stays fixed.
     deque<CRP*> node_queue;
-    set<CRP*> visited;
     node_queue.push_back(_ncrp_root);
+    if (_reject_node) {
+        node_queue.push_back(_reject_node);
+    }
+    for (DocToTopicChain::iterator c_itr = _c.begin(); c_itr != _c.end(); c_itr++) {
+        node_queue.insert(node_queue.end(), c_itr->second.begin(), c_itr->second.end());
+    }
+    for (DocSenseToTopicChain::iterator s_itr = _c_shadow.begin(); s_itr != _c_shadow.end(); s_itr++) {
+        for (DocToTopicChain::iterator c_itr = s_itr->second.begin(); c_itr != s_itr->second.end(); c_itr++) {
+            node_queue.insert(node_queue.end(), c_itr->second.begin(), c_itr->second.end());
+        }
+    }
+
+    set<CRP*> visited;
     while (!node_queue.empty()) {
         CRP* current = node_queue.front();
         node_queue.pop_front();
 
-        if (visited.find(current) != visited.end()) {
+        if (!visited.insert(current).second) {
             continue;
         }
-        visited.insert(current);
+        _eta_nodes += 1;
 
         for (WordToCountMap::iterator itr = current->nw.begin();
                 itr != current->nw.end();
                 itr++) {
-            unsigned w = itr->first;  // the word
-            unsigned count = itr->second;
-
-            lp_eta2 += gammaln(_eta[w] + count);
-            lp_new_eta2 += gammaln(new_eta[w] + count);
+            if (itr->second > 0) {
+                _word_count_histogram[itr->first][itr->second] += 1;
+            }
         }
+        _nwsum_histogram[current->nwsum] += 1;
 
-        lp_eta2 -= gammaln(current->nwsum + _eta_sum);
-        lp_new_eta2 -= gammaln(current->nwsum + new_eta_sum);
+        node_queue.insert(node_queue.end(), current->tables.begin(),
+                current->tables.end());
     }
+    _eta_histograms_built = true;
+}
 
-    // With this, we have now computed up to B^{-|V|}(\beta)
-    lp_eta *= visited.size();
-    lp_new_eta *= visited.size();
-
-    lp_eta += lp_eta2;
-    lp_new_eta += lp_new_eta2;
-
-    // Add in the prior (for now this is uniform)
-    // XXX
-
-    // Now check to see if we should MH step
-    double k = log(sample_uniform());
-
-    LOG(INFO) << "X " << lp_new_eta << " " << lp_eta << " = " << lp_new_eta - lp_eta << " " << new_eta_sum / (double)new_eta.size();
-    if (k < lp_new_eta - lp_eta) {
-        LOG(INFO) << "RESAMPLED";
-        _eta = new_eta;
-        _eta_sum = new_eta_sum;
+// Moves node out of its histogram buckets for w and nwsum and into the ones
+// for the counts after adding delta. Emptied buckets are left at zero.
+void GEMNCRPFixed::track_word_count_change(CRP* node, unsigned w, int delta) {
+    WordToCountMap::const_iterator nw_itr = node->nw.find(w);
+    unsigned count = (nw_itr == node->nw.end()) ? 0 : nw_itr->second;
+    WordToCountMap& counts = _word_count_histogram[w];
+    if (count > 0) {
+        DCHECK_GT(counts[count], 0);
+        counts[count] -= 1;
+    }
+    if (count + delta > 0) {
+        counts[count + delta] += 1;
     }
+
+    DCHECK_GT(_nwsum_histogram[node->nwsum], 0);
+    _nwsum_histogram[node->nwsum] -= 1;
+    _nwsum_histogram[node->nwsum + delta] += 1;
 }
 
 
@@ -20,6 +20,7 @@
 #ifndef SAMPLE_GEM_FIXED_NCRP_H_
 #define SAMPLE_GEM_FIXED_NCRP_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -66,11 +67,79 @@ DECLARE_bool(separate_path_assignments);
 // Should we try to learn a single best sense from a list of senses?
 DECLARE_bool(sense_selection);
 
+// Instead of rescoring every shadow sense each iteration, propose a single
+// alternative sense per document (drawn from the attachment frequencies) and
+// accept it with a Metropolis-Hastings test.
+DECLARE_bool(sense_selection_mh);
+
+// Keep a binary cache of each parsed tree structure / topic assignments file
+// next to it, so later runs over the same file skip the text parsing.
+DECLARE_bool(cache_structure_files);
+
 typedef google::dense_hash_map<unsigned, DocToTopicChain> DocSenseToTopicChain;
 typedef google::dense_hash_map<unsigned, google::dense_hash_map<unsigned, DocToWordCountMap> > DocSenseWordToCount;
 
 typedef google::dense_hash_map<unsigned, google::dense_hash_map<CRP*,double> > NodeLogFrequencyMap;
 
+// A tree structure or topic assignments file after parsing: every distinct
+// (normalized) name once, and each line as indices into the names. Lines may
+// carry a trailing numeric weight (the attachment frequency in tree files).
+// Topic assignments rows are already the per-document label lists; tree files
+// additionally carry the resolved (contracted) graph, so a cached tree doesn't
+// have to be rewired and contracted again.
+struct ParsedStructureFile {
+    ParsedStructureFile() : root(-1) { }
+
+    vector<string> names;
+    vector< vector<unsigned> > rows;
+    vector<char> has_weight;
+    vector<double> weights;
+
+    // Resolved graph, by name index (only when root >= 0)
+    vector<string> labels;               // node labels after contraction
+    vector< vector<unsigned> > parents;  // CRP::prev of each node
+    vector< vector<unsigned> > children; // CRP::tables of each node
+    int root;
+
+    // Interns name, returning its index
+    unsigned index_of(const string& name);
+
+    google::dense_hash_map<string, unsigned> name_index;  // only used while parsing
+};
+
+// Reads the binary cache next to filename if --cache_structure_files is set.
+// The cache is keyed by a hash of the file contents and by parser_id, the name
+// of the parser that wrote it (parsers normalize names differently); returns
+// false if it is missing, stale or damaged.
+bool read_structure_cache(const string& filename, const string& parser_id,
+        ParsedStructureFile* parsed);
+
+// Writes parsed to the binary cache next to filename if
+// --cache_structure_files is set
+void write_structure_cache(const string& filename, const string& parser_id,
+        const ParsedStructureFile& parsed);
+
+// Fills parsed from filename, going through the cache. parse does the actual
+// text parsing and parser_id names it.
+void load_structure_file(const string& filename, const string& parser_id,
+        void (*parse)(const string&, ParsedStructureFile*),
+        ParsedStructureFile* parsed);
+
+// Per-document constants for the multinomial level sampler, built once each
+// time a document is visited. Everything is laid out by level so the per-token
+// loop only touches contiguous arrays (and the word counts).
+struct LevelScoringContext {
+    vector<char> reject;       // is level l a REJECT node?
+    vector<unsigned> nd;       // words in d at level l
+    vector<double> log_alpha_nd;  // log(_alpha[l] + nd[l])
+    vector<double> log_eta_nwsum;  // log(_eta_sum + nwsum at level l)
+    double log_norm;  // log(alpha_sum_c_d + _nd[d] - 1)
+    double log_uniform_word;  // -log(_lV), the REJECT levels' word score
+
+    vector<int> nw;  // the current word's count at each level
+    vector<double> scores;  // the current word's score at each level
+};
+
 // This version differs from the normal GEM sampler in that the tree structure
 // is fixed a priori. Hence there is no resampling of c, the path allocations.
 class GEMNCRPFixed : public NCRPBase {
@@ -87,9 +156,50 @@ class GEMNCRPFixed : public NCRPBase {
         void resample_posterior();
         void resample_posterior_z_for(unsigned d, bool remove) { resample_posterior_z_for(d, _c[d], _z[d]); }
         void resample_posterior_z_for(unsigned d, vector<CRP*>& cd, WordToCountMap& zd);
+
+        // The multinomial (non-GEM) level sampler, scoring from a
+        // LevelScoringContext
+        void resample_posterior_z_multinomial_for(unsigned d, vector<CRP*>& cd, WordToCountMap& zd);
+
+        // Sets up ctx for document d on path cd, reading the levels' counts
+        // straight from the nodes (only through find, so this is safe to run
+        // alongside other readers)
+        void begin_level_context(unsigned d, const vector<CRP*>& cd,
+                LevelScoringContext* ctx) const;
+
+        // Refreshes level l's terms in ctx after its nd or nwsum changed
+        void update_level_context(unsigned l, int nwsum, LevelScoringContext* ctx) const {
+            ctx->log_alpha_nd[l] = log(_alpha[l] + ctx->nd[l]);
+            ctx->log_eta_nwsum[l] = log(_eta_sum + nwsum);
+        }
+
+        // Fills ctx->scores with the unnormalized log probability of word w
+        // being at each level, given the levels' counts of w in ctx->nw
+        void score_levels(unsigned w, LevelScoringContext* ctx) const;
         void resample_posterior_c_for(unsigned d); // used in sense selection
+        void resample_posterior_c_for_mh(unsigned d); // MH variant of the above
+
+        // Makes shadow sense s of document d the active one
+        void swap_in_shadow_sense(unsigned d, unsigned s);
         void resample_posterior_eta();
 
+        // Tallies, over all the nodes, how many have each (nonzero) count of
+        // each word and how many have each nwsum; the eta acceptance ratio
+        // only needs these for the perturbed words. Built the first time eta
+        // is resampled, and kept up to date by change_word_count after that.
+        void build_eta_count_histograms();
+
+        // Changes node's count of w (and its nwsum) by delta, keeping the eta
+        // histograms up to date once they've been built
+        void change_word_count(CRP* node, unsigned w, int delta) {
+            if (_eta_histograms_built) {
+                track_word_count_change(node, w, delta);
+            }
+            node->nw[w] += delta;
+            node->nwsum += delta;
+        }
+        void track_word_count_change(CRP* node, unsigned w, int delta);
+
         double compute_log_likelihood();
 
         void contract_tree();
@@ -97,6 +207,9 @@ class GEMNCRPFixed : public NCRPBase {
         void build_path_assignments(CRP* node, vector<CRP*>* c, int sense_index);
         void build_separate_path_assignments(CRP* node, vector< vector<CRP*> >* paths);
 
+        // Returns the (cached) word histogram of document d
+        const WordHistogram& doc_histogram_for(unsigned d);
+
         // Assume that all the words for document d have been assigned using the level
         // assignment zd, now remove them all.
         void remove_all_words_from(unsigned d, vector<CRP*>& cd, WordToCountMap& zd);
@@ -121,6 +234,16 @@ class GEMNCRPFixed : public NCRPBase {
 
         NodeLogFrequencyMap _log_node_freq;  // Gives the frequency of a sense attachment
 
+        google::dense_hash_map<unsigned, WordHistogram> _doc_histogram;
+
+        LevelScoringContext _level_context;  // reused across documents
+
+        // Sufficient statistics for the eta updates (see build_eta_count_histograms)
+        google::dense_hash_map<unsigned, WordToCountMap> _word_count_histogram;
+        WordToCountMap _nwsum_histogram;
+        unsigned _eta_nodes;
+        bool _eta_histograms_built;
+
         unsigned _maxL;
 };
 
@@ -35,12 +35,118 @@ DEFINE_double(gem_pi,
               "reflects our confidence in the setting m");
 
 GEMNCRP::GEMNCRP(double m, double pi)
-    : _gem_m(m), _pi(pi), _maxL(0) {
+    : _gem_m(m), _pi(pi), _maxL(0), _subtree_root(NULL) {
   _L = 3;  // for now we need an initial depth (just for the first data pt)
   _maxL = _L;
 
   CHECK_GE(_gem_m, 0.0);
   CHECK_LE(_gem_m, 1.0);
+
+  _ndsum_above.set_empty_key(kEmptyUnsignedKey);
+}
+
+void GEMNCRP::allocate_document(unsigned d) {
+  NCRPBase::allocate_document(d);
+  // The path may have been resampled after the levels were
+  _ndsum_above.erase(d);
+}
+
+vector<unsigned>& GEMNCRP::ndsum_above_for(unsigned d) {
+  google::dense_hash_map<unsigned, vector<unsigned> >::iterator itr = _ndsum_above.find(d);
+  if (itr != _ndsum_above.end()) {
+    DCHECK_EQ(itr->second.size(), _c[d].size());
+    return itr->second;
+  }
+
+  vector<unsigned>& ndsum_above = _ndsum_above[d];
+  ndsum_above.resize(_c[d].size());
+  unsigned total = 0;
+  for (int l = _c[d].size()-1; l >= 0; l--) {
+    total += _c[d][l]->nd[d];
+    ndsum_above[l] = total;
+  }
+  return ndsum_above;
+}
+
+void GEMNCRP::remove_from_ndsum_above(unsigned d, unsigned l) {
+  vector<unsigned>& ndsum_above = ndsum_above_for(d);
+  for (int k = 0; k <= l; k++) {
+    CHECK_GT(ndsum_above[k], 0);
+    ndsum_above[k] -= 1;
+  }
+}
+
+void GEMNCRP::add_to_ndsum_above(unsigned d, unsigned l) {
+  vector<unsigned>& ndsum_above = ndsum_above_for(d);
+  for (int k = 0; k <= l; k++) {
+    ndsum_above[k] += 1;
+  }
+}
+
+// Same enumeration as calculate_path_probabilities_for_subtree (new branches
+// first at each node, level by level), but with only the nCRP terms. Empty
+// subtrees are deleted along the way just like there, since whether
+// _c[d].back() still has children decides if the next token samples a branch.
+const GEMNCRP::SubtreeOptions& GEMNCRP::single_token_subtree_options(
+    unsigned d, unsigned max_depth) {
+  CRP* root = _c[d].back();
+  if (root != _subtree_root) {
+    _subtree_options.clear();
+    _subtree_root = root;
+  }
+
+  map<unsigned, SubtreeOptions>::iterator itr = _subtree_options.find(max_depth);
+  if (itr != _subtree_options.end()) {
+    return itr->second;
+  }
+
+  SubtreeOptions& options = _subtree_options[max_depth];
+  CHECK_LT(root->level, max_depth-1);
+
+  deque<pair<CRP*, double> > node_queue;
+  node_queue.push_back(make_pair(root, 0.0));
+  while (!node_queue.empty()) {
+    CRP* current = node_queue.front().first;
+    double lp = node_queue.front().second;
+    node_queue.pop_front();
+
+    if (current->ndsum == 0) {
+      CHECK(current != root) << "tried to delete the root!";
+      collect_node(current);  // this will recurse through the children
+      continue;
+    }
+
+    if (current->level < max_depth-1) {
+      double lp_norm;
+      if (FLAGS_ncrp_m_dependent_gamma) {
+        lp_norm = log((_gamma + 1) * current->ndsum - 1);
+      } else {
+        lp_norm = log(_gamma + current->ndsum - 1);
+      }
+
+      // Add the probability of escaping from this node (new branch)
+      if ((!FLAGS_ncrp_prix_fixe || current->level == max_depth-2)
+          && (FLAGS_ncrp_max_branches == -1 || current->tables.size() < FLAGS_ncrp_max_branches)) {
+        if (FLAGS_ncrp_m_dependent_gamma) {
+          options.lp.push_back(lp + log(_gamma * current->ndsum) - lp_norm);
+        } else {
+          options.lp.push_back(lp + log(_gamma) - lp_norm);
+        }
+        options.nodes.push_back(current);
+      }
+
+      for (int i = 0; i < current->tables.size(); i++) {
+        CRP* next = current->tables[i];
+        node_queue.push_back(make_pair(next, lp + log(next->ndsum) - lp_norm));
+      }
+    } else {
+      // Add the probability of reaching this node (old branch)
+      options.lp.push_back(lp);
+      options.nodes.push_back(current);
+    }
+  }
+  CHECK(!options.lp.empty());
+  return options;
 }
 
 
@@ -55,7 +161,7 @@ string GEMNCRP::current_state() {
 
   return StringPrintf(
       "ll = %f (%f at %d) %d m = %f pi = %f eta = %f gamma = %f L = %d",
-      _ll, _best_ll, _best_iter, _unique_nodes, _gem_m, _pi,
+      _ll, _best_ll, _best_iter, _stats.nodes, _gem_m, _pi,
       _eta_sum / (double)_eta.size(), _gamma,
       _maxL);
 }
@@ -70,34 +176,34 @@ string GEMNCRP::current_state() {
 // get more child nodes from the nCRP on the fly.
 void GEMNCRP::resample_posterior_z_for(unsigned d, bool remove) {
   // CHECK_EQ(_L, -1); // HACK to make sure we're not using _L
-  CHECK(false) << "implement remove";
+
+  _subtree_root = NULL;  // other documents may have changed the tree
 
     CHECK(!FLAGS_ncrp_skip_root);
   for (int n = 0; n < _D[d].size(); n++) {  // loop over every word
     unsigned w = _D[d][n];
     // Compute the new level assignment #
-    _c[d][_z[d][n]]->nw[w] -= 1;  // number of words in topic z equal to w
-    _c[d][_z[d][n]]->nd[d] -= 1;  // number of words in doc d with topic z
-    _c[d][_z[d][n]]->nwsum -= 1;  // number of words in topic z
-    _nd[d] -= 1;  // number of words in doc d
-
-
-    CHECK_GE(_c[d][_z[d][n]]->nwsum, 0);
-    CHECK_GE(_c[d][_z[d][n]]->nw[w], 0);
-    CHECK_GE(_nd[d], 0);
-    CHECK_GT(_c[d][_z[d][n]]->ndsum, 0);
+    // When the document is first being added (remove is false) its words
+    // aren't in the counts yet, so there is nothing to take out
+    if (remove) {
+      // (ndsum_above has to come first: if it isn't cached yet it is built
+      // from the counts that still include this word)
+      remove_from_ndsum_above(d, _z[d][n]);
+      _c[d][_z[d][n]]->nw[w] -= 1;  // number of words in topic z equal to w
+      _c[d][_z[d][n]]->nd[d] -= 1;  // number of words in doc d with topic z
+      _c[d][_z[d][n]]->nwsum -= 1;  // number of words in topic z
+      _nd[d] -= 1;  // number of words in doc d
+
+
+      CHECK_GE(_c[d][_z[d][n]]->nwsum, 0);
+      CHECK_GE(_c[d][_z[d][n]]->nw[w], 0);
+      CHECK_GE(_nd[d], 0);
+      CHECK_GT(_c[d][_z[d][n]]->ndsum, 0);
+    }
 
     // ndsum_above[k] is #[z_{d,-n} >= k]
-    vector<unsigned> ndsum_above;
-    ndsum_above.resize(_c[d].size());
-    ndsum_above[_c[d].size()-1] = _c[d].back()->nd[d];
-    // LOG(INFO) << "ndsum_above[" << _c[d].size()-1 << "] = "
-    //           << ndsum_above.back();
-    for (int l = _c[d].size()-2; l >= 0; l--) {
-      // TODO:: optimize this
-      ndsum_above[l] = _c[d][l]->nd[d] + ndsum_above[l+1];
-      // LOG(INFO) << "ndsum_above[" << l << "] = " << ndsum_above[l];
-    }
+    const vector<unsigned>& ndsum_above = ndsum_above_for(d);
+    DCHECK_EQ(ndsum_above[_c[d].size()-1], _c[d].back()->nd[d]);
 
     // Here we assign probabilities to all the "finite" options, e.g. all
     // the levels up to the current maximum level for this document. TODO::
@@ -154,35 +260,25 @@ void GEMNCRP::resample_posterior_z_for(unsigned d, bool remove) {
       // subtree path starting at the old end of c[d] and augmenting it to get
       // a path to new_max_level
 
-      // Keep track of the removed counts for computing the likelihood of
-      // the data
-      // HACK: we only remove one at a time, so this can be optimized....
-      LevelWordToCountMap nw_removed;
-      LevelToCountMap     nwsum_removed;
-      nw_removed[_z[d][n]][w] += 1;
-      nwsum_removed[_z[d][n]] += 1;
-
-      vector<double> lp_c_d;  // log-probability of this branch c_d
-      vector<CRP*> c_d;  // the actual branch c_d
-      calculate_path_probabilities_for_subtree(_c[d].back(), d, new_max_level,
-                                               nw_removed, nwsum_removed,
-                                               &lp_c_d, &c_d);
+      // Only this token is removed, and it sits at or above _c[d].back(),
+      // so the options are scored by the cached nCRP terms alone
+      const SubtreeOptions& options = single_token_subtree_options(d, new_max_level);
 
       // Choose a new leaf node
-      int index = sample_unnormalized_log_multinomial(&lp_c_d);
+      int index = sample_unnormalized_log_multinomial(&options.lp[0], options.lp.size());
 
-      new_leaf = c_d[index];  // keep a pointer around for later
+      new_leaf = options.nodes[index];  // keep a pointer around for later
 
       // If we choose to create a new branch at a level less than our
       // desired level, then it can have no words already added, hence the
       // word probability is the default.
-      if (c_d[index]->level < new_max_level) {
+      if (new_leaf->level < new_max_level) {
         // then there are no words below here
         lp_w_dn = log(_eta[w]) - log(_eta_sum);
       } else {
         // TODO: this is slow
         // replay back to level level
-        CRP* current = c_d[index];
+        CRP* current = new_leaf;
         while (current->level > new_max_level-1) {
           CHECK(false);  // shouldn't get here
           current = current->prev[0];
@@ -212,8 +308,11 @@ void GEMNCRP::resample_posterior_z_for(unsigned d, bool remove) {
         if (_c[d][l]->nd[d] == 0) {
           CHECK_GT(_c[d][l]->ndsum, 0);
           _c[d][l]->ndsum -= 1;
+          _stats.ndsum -= 1;
           _c[d].pop_back();
           CHECK(_c[d].size() == l);
+          CHECK_EQ(_ndsum_above[d].back(), 0);
+          _ndsum_above[d].pop_back();
         } else {
           break;  // break off early to allow nd=1 -> nd=0 -> nd=1
         }
@@ -229,6 +328,9 @@ void GEMNCRP::resample_posterior_z_for(unsigned d, bool remove) {
       for (int l = old_size; l < _c[d].size(); l++) {
         _c[d][l]->ndsum += 1;
       }
+      _stats.ndsum += _c[d].size() - old_size;
+      _ndsum_above[d].resize(_c[d].size(), 0);
+      _subtree_root = NULL;  // the subtree's counts changed
     }
 
 
@@ -247,7 +349,10 @@ void GEMNCRP::resample_posterior_z_for(unsigned d, bool remove) {
     _c[d][_z[d][n]]->nw[w] += 1;  // number of words in topic z equal to w
     _c[d][_z[d][n]]->nd[d] += 1;  // number of words in doc d with topic z
     _c[d][_z[d][n]]->nwsum += 1;  // number of words in topic z
-    _nd[d] += 1;  // number of words in doc d
+    if (remove) {
+      _nd[d] += 1;  // number of words in doc d (already counted when adding)
+    }
+    add_to_ndsum_above(d, _z[d][n]);
 
     CHECK_GT(_c[d][_z[d][n]]->ndsum, 0);
 
@@ -273,6 +378,7 @@ void GEMNCRP::resample_posterior() {
 
     // LOG(INFO) <<  "  resampling document " <<  d;
     resample_posterior_c_for(d);
+    _ndsum_above.erase(d);  // built along the old path
     // DCHECK(tree_is_consistent());
     for (int z = 0; z < FLAGS_ncrp_z_per_iteration; z++) {
       resample_posterior_z_for(d, true);
@@ -284,7 +390,6 @@ void GEMNCRP::resample_posterior() {
 double GEMNCRP::compute_log_likelihood() {
   // Compute the log likelihood for the tree
   double log_lik = 0;
-  _unique_nodes = 0;  // recalculate the tree size
   // Compute the log likelihood of the tree
   deque<CRP*> node_queue;
   node_queue.push_back(_ncrp_root);
@@ -293,8 +398,6 @@ double GEMNCRP::compute_log_likelihood() {
     CRP* current = node_queue.front();
     node_queue.pop_front();
 
-    _unique_nodes += 1;
-
     // Should never have words attached but no documents
     CHECK(!(current->ndsum == 0 && current->nwsum > 0));
 
@@ -314,17 +417,22 @@ double GEMNCRP::compute_log_likelihood() {
   for (DocumentMap::const_iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
       unsigned d = d_itr->first;
 
-    // TODO: inefficient?
     // ndsum_above[k] is #[z_{d,-n} >= k]
-    vector<unsigned> ndsum_above;
-    for (int l = 0; l < _c[d].size(); l++) {
-      // TODO: optimize this
-      ndsum_above.push_back(0);
-      // count the total words attached for this document below here
-      for (int ll = l; ll < _c[d].size(); ll++) {
-        ndsum_above[l] += _c[d][ll]->nd[d];
+    const vector<unsigned>& ndsum_above = ndsum_above_for(d);
+
+    // The stick-breaking terms only depend on the level, so accumulate them
+    // once per document: V_j_sum[l] is the sum of the terms for levels < l,
+    // and lp_level[l] the level's own contribution.
+    unsigned L = _c[d].size();
+    vector<double> V_j_sum(L, 0);
+    vector<double> lp_level(L);
+    for (int l = 0; l < L; l++) {
+      if (l > 0) {
+        V_j_sum[l] = V_j_sum[l-1] + log(_gem_m*_pi + ndsum_above[l]) -
+            log(_pi + ndsum_above[l-1]);
       }
-      // LOG(INFO) << "ndsum_above[" << l << "] = " << ndsum_above[l];
+      lp_level[l] = log((1-_gem_m)*_pi + _c[d][l]->nd[d]) -
+          log(_pi + ndsum_above[l]) + V_j_sum[l];
     }
 
     for (int n = 0; n < _D[d].size(); n++) {
@@ -334,23 +442,18 @@ double GEMNCRP::compute_log_likelihood() {
           log(_c[d][_z[d][n]]->nwsum+_eta_sum);
 
       // likelihood of the topic?
-      // TODO: this is heinously inefficient
-      double V_j_sum = 0;
-      for (int l = 0; l < _z[d][n]; l++) {
-        if (l < _c[d].size()-1) {
-          V_j_sum += log(_gem_m*_pi + ndsum_above[l+1]) -
-              log(_pi + ndsum_above[l]);
-        }
-      }
-
-      log_lik += log((1-_gem_m)*_pi + _c[d][_z[d][n]]->nd[d]) -
-          log(_pi + ndsum_above[_z[d][n]]) + V_j_sum;
+      log_lik += lp_level[_z[d][n]];
     }
   }
   return log_lik;
 }
 
 int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  init_random();
+
   GEMNCRP h = GEMNCRP(FLAGS_gem_m, FLAGS_gem_pi);
   h.load_data(FLAGS_ncrp_datafile);
 
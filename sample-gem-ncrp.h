@@ -23,6 +23,7 @@
 #ifndef SAMPLE_GEM_NCRP_H_
 #define SAMPLE_GEM_NCRP_H_
 
+#include <map>
 #include <string>
 
 #include "ncrp-base.h"
@@ -42,16 +43,49 @@ class GEMNCRP : public NCRPBase {
 
   string current_state();
  private:
+  void allocate_document(unsigned d);
   void resample_posterior();
   void resample_posterior_z_for(unsigned d, bool remove);
 
   double compute_log_likelihood();
 
+  // Returns ndsum_above for d, building it from the path if needed
+  vector<unsigned>& ndsum_above_for(unsigned d);
+
+  // Update ndsum_above when a token of d leaves or joins level l
+  void remove_from_ndsum_above(unsigned d, unsigned l);
+  void add_to_ndsum_above(unsigned d, unsigned l);
+
+  // Ways of extending a path below some node down to a given depth, along
+  // with their nCRP log probabilities (relative to reaching the node)
+  struct SubtreeOptions {
+    vector<double> lp;
+    vector<CRP*> nodes;
+  };
+
+  // Returns the options for extending _c[d] to max_depth when placing a
+  // single token at a new level. With only one token removed, the data
+  // likelihood is identical for every option (the token's level lies on the
+  // shared part of the path), so the options only depend on the tree and are
+  // cached until d's path changes. Empty subtrees below _c[d] are collected.
+  const SubtreeOptions& single_token_subtree_options(unsigned d, unsigned max_depth);
+
  private:
   double _gem_m;
   double _pi;
 
   unsigned _maxL;
+
+  // Per-document suffix sums of the level histogram: _ndsum_above[d][k] is
+  // #[z_{d,n} >= k]. Kept in step with the level assignments so neither the
+  // level sampler nor the likelihood has to rebuild it; dropped whenever d's
+  // path is replaced.
+  google::dense_hash_map<unsigned, vector<unsigned> > _ndsum_above;
+
+  // Cache for single_token_subtree_options, keyed by max depth; valid for
+  // the subtree below _subtree_root only
+  map<unsigned, SubtreeOptions> _subtree_options;
+  CRP* _subtree_root;
 };
 
 #endif  // SAMPLE_GEM_NCRP_H_
@@ -25,46 +25,119 @@
 #include "ncrp-base.h"
 #include "sample-mult-ncrp.h"
 
+// The log likelihood is tracked incrementally as the counts change; every this
+// many iterations it is recomputed from scratch to wash out any numerical
+// drift. 0 recomputes it every iteration.
+DEFINE_int32(ncrp_ll_recompute_interval,
+             25,
+             "iterations between exact log likelihood recomputes (0 = always)");
+
+// Largest depth that gets its own compile-time specialized level kernel
+const unsigned kMaxSpecializedDepth = 8;
+
+// n*log(n + a): the total contribution of a count n with smoothing a to the
+// per-token log likelihood, since each of the n tokens sees the final count
+inline double count_log_lik(unsigned n, double a) {
+    return n == 0 ? 0 : n * log(n + a);
+}
+
+// Change in count_log_lik when a count goes from n to n+k
+inline double count_log_lik_delta(unsigned n, unsigned k, double a) {
+    return count_log_lik(n + k, a) - count_log_lik(n, a);
+}
+
+FixedDepthNCRP::FixedDepthNCRP()
+    : _ll_tree(0), _ll_words(0), _ll_docs(0), _ll_valid(false), _ll_exact_iter(0) {
+    if (FLAGS_ncrp_skip_root) {
+        _z_kernel = select_level_kernel<true>();
+    } else {
+        _z_kernel = select_level_kernel<false>();
+    }
+}
+
+template <bool kSkipRoot>
+FixedDepthNCRP::LevelKernel FixedDepthNCRP::select_level_kernel() {
+    switch (_L) {
+        case 2: return &FixedDepthNCRP::resample_posterior_z_kernel<2, kSkipRoot>;
+        case 3: return &FixedDepthNCRP::resample_posterior_z_kernel<3, kSkipRoot>;
+        case 4: return &FixedDepthNCRP::resample_posterior_z_kernel<4, kSkipRoot>;
+        case 5: return &FixedDepthNCRP::resample_posterior_z_kernel<5, kSkipRoot>;
+        case 6: return &FixedDepthNCRP::resample_posterior_z_kernel<6, kSkipRoot>;
+        case 7: return &FixedDepthNCRP::resample_posterior_z_kernel<7, kSkipRoot>;
+        case kMaxSpecializedDepth: return &FixedDepthNCRP::resample_posterior_z_kernel<kMaxSpecializedDepth, kSkipRoot>;
+        default: return &FixedDepthNCRP::resample_posterior_z_kernel<0, kSkipRoot>;
+    }
+}
+
 // Performs a single document's level assignment resample step
-void FixedDepthNCRP::resample_posterior_z_for(unsigned d, bool remove) {
+template <unsigned kL, bool kSkipRoot>
+void FixedDepthNCRP::resample_posterior_z_kernel(unsigned d, bool remove) {
     VLOG(1) << "resample posterior z for " << d;
 
-    for (int n = 0; n < _D[d].size(); n++) {
-        unsigned w = _D[d][n];
+    const unsigned L = (kL > 0) ? kL : _L;
+    const unsigned start = kSkipRoot ? 1 : 0;
+
+    // Scores live on the stack when the depth is known at compile time
+    double lp_z_dn_fixed[kL > 0 ? kL : 1];
+    unsigned nd_l_fixed[kL > 0 ? kL : 1];
+    if (kL == 0) {
+        _lp_z_dn.resize(L);
+        _nd_l.resize(L);
+    }
+    double* lp_z_dn = (kL > 0) ? lp_z_dn_fixed : &_lp_z_dn[0];
+    unsigned* nd_l = (kL > 0) ? nd_l_fixed : &_nd_l[0];
+
+    // Everything that only depends on d is looked up once per document
+    const Document& D = _D[d];
+    vector<CRP*>& cd = _c[d];
+    WordToCountMap& zd = _z[d];
+    double lnd = log(_alpha_sum + _nd[d]-1);
+
+    CHECK_EQ(cd.size(), L);
+
+    // nd[d] for each node on the path, tracked locally as words move
+    for (unsigned l = 0; l < L; l++) {
+        nd_l[l] = cd[l]->nd[d];
+    }
+
+    for (int n = 0; n < D.size(); n++) {
+        unsigned w = D[n];
 
         if (remove) {
             // Remove this document and word from the counts
-            _c[d][_z[d][n]]->remove_no_ndsum(w,d);
+            unsigned z = zd[n];
+            cd[z]->remove_no_ndsum(w,d);
+            nd_l[z] -= 1;
         }
 
-        vector<double> lp_z_dn;
-
-        unsigned start = FLAGS_ncrp_skip_root ? 1 : 0;
-        for (int l = start; l < _L; l++) {
+        for (unsigned l = start; l < L; l++) {
             // check that ["doesnt exist"]->0
-            DCHECK(_c[d][l]->nw.find(w) != _c[d][l]->nw.end() || _c[d][l]->nw[w] == 0);
-            DCHECK(_c[d][l]->nd.find(d) != _c[d][l]->nd.end() || _c[d][l]->nd[d] == 0);
-
-            lp_z_dn.push_back(log(_eta[w] + _c[d][l]->nw[w]) -
-                    log(_eta_sum + _c[d][l]->nwsum) +
-                    log(_alpha[l] + _c[d][l]->nd[d]) -
-                    log(_alpha_sum + _nd[d]-1));
+            DCHECK(cd[l]->nw.find(w) != cd[l]->nw.end() || cd[l]->nw[w] == 0);
+            DCHECK(cd[l]->nd.find(d) != cd[l]->nd.end() || cd[l]->nd[d] == 0);
+            DCHECK_EQ(cd[l]->nd[d], nd_l[l]);
+
+            lp_z_dn[l-start] = log(_eta[w] + cd[l]->nw[w]) -
+                    log(_eta_sum + cd[l]->nwsum) +
+                    log(_alpha[l] + nd_l[l]) -
+                    lnd;
         }
 
         // Update the assignment
-        // _z[d][n] = SAFE_sample_unnormalized_log_multinomial(&lp_z_dn) + start;
-        _z[d][n] = sample_unnormalized_log_multinomial(&lp_z_dn) + start;
+        unsigned z = sample_unnormalized_log_multinomial(lp_z_dn, L-start) + start;
+        if (remove && _ll_valid && z != zd[n]) {
+            track_level_move(w, d, zd[n], nd_l[zd[n]], z, nd_l[z]);
+        }
+        zd[n] = z;
 
         // Update the counts
 
         // Check to see that the default dictionary insertion works like we
         // expect
-        DCHECK(_c[d][_z[d][n]]->nw.find(w) != _c[d][_z[d][n]]->nw.end()
-                || _c[d][_z[d][n]]->nw[w] == 0);
-        DCHECK(_c[d][_z[d][n]]->nd.find(d) != _c[d][_z[d][n]]->nd.end()
-                || _c[d][_z[d][n]]->nd[d] == 0);
+        DCHECK(cd[z]->nw.find(w) != cd[z]->nw.end() || cd[z]->nw[w] == 0);
+        DCHECK(cd[z]->nd.find(d) != cd[z]->nd.end() || cd[z]->nd[d] == 0);
 
-        _c[d][_z[d][n]]->add_no_ndsum(w,d);
+        cd[z]->add_no_ndsum(w,d);
+        nd_l[z] += 1;
     }
 }
 
@@ -107,7 +180,9 @@ void FixedDepthNCRP::resample_posterior() {
       unsigned d = d_itr->first;
 
       if (FLAGS_ncrp_depth > 1 && FLAGS_ncrp_max_branches != 1) {
+          begin_path_move(d);
           resample_posterior_c_for(d);
+          finish_path_move(d);
       }
       // BAD BAD: skipping check
       // DCHECK(tree_is_consistent());
@@ -121,11 +196,29 @@ void FixedDepthNCRP::resample_posterior() {
 }
 
 
+// Returns the tracked log likelihood, falling back to an exact recompute when
+// the components are stale or the recompute interval is up
 double FixedDepthNCRP::compute_log_likelihood() {
+    if (!_ll_valid || FLAGS_ncrp_ll_recompute_interval <= 0
+            || _iter - _ll_exact_iter >= FLAGS_ncrp_ll_recompute_interval) {
+        double tracked = _ll_tree + _ll_words + _ll_docs;
+        bool was_valid = _ll_valid;
+
+        compute_exact_log_likelihood();
+
+        if (was_valid) {
+            VLOG(1) << "log likelihood drift " << (_ll_tree + _ll_words + _ll_docs) - tracked;
+        }
+    }
+    return _ll_tree + _ll_words + _ll_docs;
+}
+
+void FixedDepthNCRP::compute_exact_log_likelihood() {
     // VLOG(1) << "compute log likelihood " ;
     // Compute the log likelihood for the tree
-    double log_lik = 0;
-    _unique_nodes = 0;  // recalculate the tree size
+    _ll_tree = 0;
+    _ll_words = 0;
+    _ll_docs = 0;
     // Compute the log likelihood of the tree
     deque<CRP*> node_queue;
     node_queue.push_back(_ncrp_root);
@@ -134,15 +227,13 @@ double FixedDepthNCRP::compute_log_likelihood() {
         CRP* current = node_queue.front();
         node_queue.pop_front();
 
-        _unique_nodes += 1;
-
         if (current->tables.size() > 0) {
             for (int i = 0; i < current->tables.size(); i++) {
                 CHECK_GT(current->tables[i]->ndsum, 0);
                 if (FLAGS_ncrp_m_dependent_gamma) {
-                    log_lik += log(current->tables[i]->ndsum) - log(current->ndsum * (_gamma + 1) - 1);
+                    _ll_tree += log(current->tables[i]->ndsum) - log(current->ndsum * (_gamma + 1) - 1);
                 } else {
-                    log_lik += log(current->tables[i]->ndsum) - log(current->ndsum+_gamma-1);
+                    _ll_tree += log(current->tables[i]->ndsum) - log(current->ndsum+_gamma-1);
                 }
             }
 
@@ -159,13 +250,142 @@ double FixedDepthNCRP::compute_log_likelihood() {
         for (int n = 0; n < _D[d].size(); n++) {
             // likelihood of drawing this word
             unsigned w = _D[d][n];
-            log_lik += log(_c[d][_z[d][n]]->nw[w]+_eta[w]) -
+            _ll_words += log(_c[d][_z[d][n]]->nw[w]+_eta[w]) -
                 log(_c[d][_z[d][n]]->nwsum+_eta_sum);
             // likelihood of the topic?
-            log_lik += log(_c[d][_z[d][n]]->nd[d]+_alpha[_z[d][n]]) - lndsumd;
+            _ll_docs += log(_c[d][_z[d][n]]->nd[d]+_alpha[_z[d][n]]) - lndsumd;
+        }
+    }
+
+    _ll_valid = true;
+    _ll_exact_iter = _iter;
+}
+
+// The tree part of the log likelihood is a sum over parent/child pairs of
+// log(child->ndsum) - log(normalizer(parent->ndsum)), which splits into a
+// per-node term depending only on the node's own ndsum and number of tables
+double FixedDepthNCRP::node_tree_log_likelihood(CRP* node, unsigned ndsum, unsigned tables) {
+    double ll = 0;
+    if (!node->prev.empty()) {
+        ll += log(ndsum);
+    }
+    if (tables > 0) {
+        if (FLAGS_ncrp_m_dependent_gamma) {
+            ll -= tables * log(ndsum * (_gamma + 1) - 1);
+        } else {
+            ll -= tables * log(ndsum + _gamma - 1);
         }
     }
-    return log_lik;
+    return ll;
+}
+
+// Moving a single token between levels of its path only touches the counts at
+// the two nodes involved. The counts passed in have the token removed.
+void FixedDepthNCRP::track_level_move(unsigned w, unsigned d,
+        unsigned z_old, unsigned nd_old,
+        unsigned z_new, unsigned nd_new) {
+    CRP* from = _c[d][z_old];
+    CRP* to = _c[d][z_new];
+
+    _ll_words -= count_log_lik_delta(from->nw[w], 1, _eta[w])
+        - count_log_lik_delta(from->nwsum, 1, _eta_sum);
+    _ll_words += count_log_lik_delta(to->nw[w], 1, _eta[w])
+        - count_log_lik_delta(to->nwsum, 1, _eta_sum);
+
+    _ll_docs -= count_log_lik_delta(nd_old, 1, _alpha[z_old]);
+    _ll_docs += count_log_lik_delta(nd_new, 1, _alpha[z_new]);
+}
+
+// Remembers d's current path and its share of the tree log likelihood
+void FixedDepthNCRP::begin_path_move(unsigned d) {
+    if (!_ll_valid) {
+        return;
+    }
+    _old_path = _c[d];
+    _old_tree_ll = 0;
+
+    // Nodes holding only d will be collected once it is removed
+    _old_first_collected = _old_path.size();
+    for (int l = 0; l < _old_path.size(); l++) {
+        if (_old_path[l]->ndsum == 1 && _old_first_collected == _old_path.size()) {
+            _old_first_collected = l;
+        }
+        _old_tree_ll += node_tree_log_likelihood(_old_path[l]);
+    }
+}
+
+// Applies the change in log likelihood from moving d to its new path. The
+// level assignments don't change, so the topic term is unaffected, and levels
+// where the old and new paths share a node cancel out.
+void FixedDepthNCRP::finish_path_move(unsigned d) {
+    if (!_ll_valid) {
+        return;
+    }
+    vector<CRP*>& cd = _c[d];
+    CHECK_EQ(cd.size(), _old_path.size());
+
+    if (_old_first_collected == _old_path.size() && cd == _old_path) {
+        return;  // stayed put
+    }
+
+    // Tree term: every node whose ndsum or table count changed is on one of
+    // the two paths. The old path was scored in begin_path_move (collected
+    // nodes simply drop out); nodes only on the new path are scored as they
+    // were before d arrived. Freshly grafted nodes hold only d and didn't
+    // exist before.
+    double new_tree_ll = 0;
+    for (int l = 0; l < cd.size(); l++) {
+        new_tree_ll += node_tree_log_likelihood(cd[l]);
+
+        bool on_old_path = l < _old_first_collected && cd[l] == _old_path[l];
+        if (!on_old_path && cd[l]->ndsum > 1) {
+            bool grafted_child = l+1 < cd.size() && cd[l+1]->ndsum == 1;
+            new_tree_ll -= node_tree_log_likelihood(cd[l], cd[l]->ndsum - 1,
+                    cd[l]->tables.size() - (grafted_child ? 1 : 0));
+        }
+    }
+    for (int l = 0; l < _old_first_collected; l++) {
+        if (cd[l] != _old_path[l]) {
+            new_tree_ll += node_tree_log_likelihood(_old_path[l]);
+        }
+    }
+    _ll_tree += new_tree_ll - _old_tree_ll;
+
+    // Word term: d's words left the old nodes and joined the new ones
+    LevelWordToCountMap nw_moved;
+    LevelToCountMap nwsum_moved;
+    nw_moved.set_empty_key(kEmptyUnsignedKey);
+    nwsum_moved.set_empty_key(kEmptyUnsignedKey);
+    for (int n = 0; n < _D[d].size(); n++) {
+        nw_moved[_z[d][n]][_D[d][n]] += 1;
+        nwsum_moved[_z[d][n]] += 1;
+    }
+
+    for (LevelToCountMap::iterator l_itr = nwsum_moved.begin(); l_itr != nwsum_moved.end(); l_itr++) {
+        unsigned l = l_itr->first;
+        unsigned total = l_itr->second;
+        if (l < _old_first_collected && cd[l] == _old_path[l]) {
+            continue;
+        }
+        bool collected = l >= _old_first_collected;
+        CRP* from = _old_path[l];
+        CRP* to = cd[l];
+
+        WordToCountMap& moved = nw_moved[l];
+        for (WordToCountMap::iterator itr = moved.begin(); itr != moved.end(); itr++) {
+            unsigned w = itr->first;
+            unsigned count = itr->second;
+            unsigned remaining = 0;
+            if (!collected) {
+                WordToCountMap::iterator nw_itr = from->nw.find(w);
+                remaining = nw_itr == from->nw.end() ? 0 : nw_itr->second;
+            }
+            _ll_words -= count_log_lik_delta(remaining, count, _eta[w]);
+            _ll_words += count_log_lik_delta(to->nw[w] - count, count, _eta[w]);
+        }
+        _ll_words += count_log_lik_delta(collected ? 0 : from->nwsum, total, _eta_sum);
+        _ll_words -= count_log_lik_delta(to->nwsum - total, total, _eta_sum);
+    }
 }
 
 string FixedDepthNCRP::current_state() {
@@ -178,19 +398,269 @@ string FixedDepthNCRP::current_state() {
 
   return StringPrintf(
       "ll = %f (%f at %d) %d alpha = %f eta = %f gamma = %f L = %d",
-      _ll, _best_ll, _best_iter, _unique_nodes,
+      _ll, _best_ll, _best_iter, _stats.nodes,
       _alpha_sum / (double)_alpha.size(),
       _eta_sum / (double)_eta.size(), _gamma, _L);
 }
 
+FlatDPMixtureNCRP::FlatDPMixtureNCRP() : _slab_width(0) {
+    CHECK(applies());
+    CHECK_EQ(_L, 2);
+
+    _histogram.set_empty_key(kEmptyUnsignedKey);
+
+    _eta_scale = FLAGS_ncrp_eta_depth_scale < 1.0 ? FLAGS_ncrp_eta_depth_scale : 1.0;
+}
+
+bool FlatDPMixtureNCRP::applies() {
+    return FLAGS_ncrp_depth == 2 && FLAGS_ncrp_skip_root
+        && FLAGS_preassigned_topics == 0;
+}
+
+// Same incremental construction as NCRPBase::allocate_document, except that
+// every word goes straight to the leaf
+void FlatDPMixtureNCRP::allocate_document(unsigned d) {
+    CHECK(!_ncrp_root->tables.empty());
+
+    _c[d].push_back(_ncrp_root);
+    _c[d].push_back(_ncrp_root->tables[0]);
+    _ncrp_root->ndsum += 1;
+    _c[d][1]->ndsum += 1;
+    _stats.ndsum += 2;
+    _stats.nwsum += _D[d].size();
+
+    resample_posterior_z_for(d, false);
+
+    if (d > 0 && FLAGS_ncrp_max_branches != 1) {
+        resample_posterior_c_for(d);
+    }
+
+    if (d % 1000 == 0 && d > 0) {
+      LOG(INFO) << "Sorted " << d << " documents into " << _stats.nodes << " clusters.";
+    }
+}
+
+void FlatDPMixtureNCRP::resample_posterior() {
+    CHECK_GT(_lV, 0);
+    CHECK_GT(_lD, 0);
+
+    // The level assignments are fixed at 1, so there is nothing to do for z
+    if (FLAGS_ncrp_max_branches != 1) {
+        for (DocumentMap::const_iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
+            unsigned d = d_itr->first;
+            begin_path_move(d);
+            resample_posterior_c_for(d);
+            finish_path_move(d);
+        }
+    }
+
+    print_summary();
+}
+
+// With the root skipped, the only possible level is the leaf; this just
+// establishes the assignment when a document is first added.
+void FlatDPMixtureNCRP::resample_posterior_z_for(unsigned d, bool remove) {
+    if (remove) {
+        return;
+    }
+    for (int n = 0; n < _D[d].size(); n++) {
+        _z[d][n] = 1;
+    }
+    add_document_to(_c[d][1], d, histogram_for(d));
+}
+
+const FlatDPMixtureNCRP::DocumentHistogram& FlatDPMixtureNCRP::histogram_for(unsigned d) {
+    google::dense_hash_map<unsigned, DocumentHistogram>::iterator itr = _histogram.find(d);
+    if (itr != _histogram.end()) {
+        return itr->second;
+    }
+
+    DocumentHistogram& h = _histogram[d];
+    build_word_histogram(_D[d], &h);
+
+    h.lp_new_cluster = gammaln(_eta_sum*_eta_scale) - gammaln(h.total + _eta_sum*_eta_scale);
+    for (int i = 0; i < h.words.size(); i++) {
+        unsigned w = h.words[i];
+        h.lp_new_cluster += gammaln(h.counts[i] + _eta[w]*_eta_scale) - gammaln(_eta[w]*_eta_scale);
+    }
+    return h;
+}
+
+void FlatDPMixtureNCRP::add_document_to(CRP* cluster, unsigned d, const WordHistogram& h) {
+    for (int i = 0; i < h.words.size(); i++) {
+        cluster->nw[h.words[i]] += h.counts[i];
+    }
+    cluster->nwsum += h.total;
+    cluster->nd[d] += h.total;
+    update_slab(cluster, h, 1);
+}
+
+void FlatDPMixtureNCRP::remove_document_from(CRP* cluster, unsigned d, const WordHistogram& h) {
+    for (int i = 0; i < h.words.size(); i++) {
+        unsigned w = h.words[i];
+        CHECK_GE(cluster->nw[w], h.counts[i]);
+        cluster->nw[w] -= h.counts[i];
+        if (cluster->nw[w] == 0) {
+            cluster->nw.erase(w);
+        }
+    }
+    CHECK_GE(cluster->nwsum, h.total);
+    cluster->nwsum -= h.total;
+    cluster->nd[d] -= h.total;
+    CHECK_EQ(cluster->nd[d], 0);
+    update_slab(cluster, h, -1);
+}
+
+unsigned FlatDPMixtureNCRP::slot_for(CRP* cluster) {
+    map<CRP*, unsigned>::iterator itr = _slot.find(cluster);
+    if (itr != _slot.end()) {
+        return itr->second;
+    }
+
+    unsigned slot;
+    if (!_free_slots.empty()) {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+    } else {
+        slot = _slab_nw.size();
+        _slab_nw.push_back(vector<unsigned>(_slab_width, 0));
+        _slab_nwsum.push_back(0);
+        _slab_ndsum.push_back(0);
+    }
+    _slot[cluster] = slot;
+    return slot;
+}
+
+void FlatDPMixtureNCRP::release_slot(CRP* cluster) {
+    map<CRP*, unsigned>::iterator itr = _slot.find(cluster);
+    CHECK(itr != _slot.end());
+    unsigned slot = itr->second;
+    // Only empty leaves are collected, so the row is already all zeros
+    CHECK_EQ(_slab_nwsum[slot], 0);
+    CHECK_EQ(_slab_ndsum[slot], 0);
+    _free_slots.push_back(slot);
+    _slot.erase(itr);
+}
+
+void FlatDPMixtureNCRP::update_slab(CRP* cluster, const WordHistogram& h, int sign) {
+    grow_slabs();
+    unsigned slot = slot_for(cluster);
+    vector<unsigned>& nw = _slab_nw[slot];
+    for (int i = 0; i < h.words.size(); i++) {
+        nw[h.words[i]] += sign * (int)h.counts[i];
+    }
+    _slab_nwsum[slot] += sign * (int)h.total;
+    _slab_ndsum[slot] += sign;
+}
+
+void FlatDPMixtureNCRP::grow_slabs() {
+    if (_slab_width >= _lV) {
+        return;
+    }
+    _slab_width = _lV;
+    for (int s = 0; s < _slab_nw.size(); s++) {
+        _slab_nw[s].resize(_slab_width, 0);
+    }
+}
+
+// Resamples the cluster for d: the Gibbs step of a DP mixture with a
+// Dirichlet-multinomial likelihood. Scores come out in the same order as the
+// tree kernel produces them (new cluster first, then root->tables).
+void FlatDPMixtureNCRP::resample_posterior_c_for(unsigned d) {
+    VLOG(1) << "resample posterior c for " << d;
+    const DocumentHistogram& h = histogram_for(d);
+    vector<CRP*>& cd = _c[d];
+    CRP* root = _ncrp_root;
+
+    // Remove d from its current cluster, dropping the cluster if it is empty
+    remove_document_from(cd[1], d, h);
+    root->ndsum -= 1;
+    cd[1]->ndsum -= 1;
+    if (cd[1]->ndsum == 0) {
+        release_slot(cd[1]);
+        collect_node(cd[1]);
+    }
+
+    vector<CRP*>& clusters = root->tables;
+    unsigned K = clusters.size();
+    bool can_branch = FLAGS_ncrp_max_branches == -1 || K < FLAGS_ncrp_max_branches;
+    unsigned offset = can_branch ? 1 : 0;
+
+    _lp_cluster.resize(K + offset);
+
+    double lp_norm;
+    if (FLAGS_ncrp_m_dependent_gamma) {
+        lp_norm = log((_gamma + 1) * root->ndsum - 1);
+    } else {
+        lp_norm = log(_gamma + root->ndsum - 1);
+    }
+
+    if (can_branch) {
+        if (FLAGS_ncrp_m_dependent_gamma) {
+            _lp_cluster[0] = log(_gamma * root->ndsum) - lp_norm + h.lp_new_cluster;
+        } else {
+            _lp_cluster[0] = log(_gamma) - lp_norm + h.lp_new_cluster;
+        }
+    }
+
+    // Look up the leaves' slots once, then score straight off the slabs
+    grow_slabs();
+    _table_slots.resize(K);
+    for (unsigned k = 0; k < K; k++) {
+        _table_slots[k] = slot_for(clusters[k]);
+    }
+
+    double eta_sum = _eta_sum*_eta_scale;
+    for (unsigned k = 0; k < K; k++) {
+        unsigned slot = _table_slots[k];
+        const unsigned* nw = &_slab_nw[slot][0];
+        unsigned nwsum = _slab_nwsum[slot];
+        DCHECK_EQ(nwsum, clusters[k]->nwsum);
+        double lp = log(_slab_ndsum[slot]) - lp_norm
+            + gammaln(nwsum + eta_sum)
+            - gammaln(nwsum + h.total + eta_sum);
+
+        for (int i = 0; i < h.words.size(); i++) {
+            unsigned w = h.words[i];
+            double eta = _eta[w]*_eta_scale;
+            lp += gammaln(nw[w] + h.counts[i] + eta) - gammaln(nw[w] + eta);
+        }
+        _lp_cluster[k + offset] = lp;
+    }
+
+    unsigned index = sample_unnormalized_log_multinomial(&_lp_cluster[0], _lp_cluster.size());
+
+    CRP* chosen;
+    if (index < offset) {
+        chosen = graft_node(1, root);
+    } else {
+        chosen = clusters[index - offset];
+    }
+
+    cd[1] = chosen;
+    root->ndsum += 1;
+    chosen->ndsum += 1;
+    add_document_to(chosen, d, h);
+
+    VLOG(1) << "done";
+}
+
 int main(int argc, char **argv) {
     google::InitGoogleLogging(argv[0]);
     google::ParseCommandLineFlags(&argc, &argv, true);
 
     init_random();
 
-    FixedDepthNCRP h = FixedDepthNCRP();
-    h.load_data(FLAGS_ncrp_datafile);
+    if (FlatDPMixtureNCRP::applies()) {
+        LOG(INFO) << "using the flat DP mixture engine";
+        FlatDPMixtureNCRP h;
+        h.load_data(FLAGS_ncrp_datafile);
 
-    h.run();
+        h.run();
+    } else {
+        FixedDepthNCRP h = FixedDepthNCRP();
+        h.load_data(FLAGS_ncrp_datafile);
+
+        h.run();
+    }
 }
@@ -20,17 +20,130 @@
 #ifndef SAMPLE_MULT_NCRP_H_
 #define SAMPLE_MULT_NCRP_H_
 
+// The log likelihood is tracked incrementally as the counts change; every this
+// many iterations it is recomputed from scratch to wash out any numerical
+// drift. 0 recomputes it every iteration.
+DECLARE_int32(ncrp_ll_recompute_interval);
+
 class FixedDepthNCRP : public NCRPBase {
     public:
-        FixedDepthNCRP() { }
+        FixedDepthNCRP();
         ~FixedDepthNCRP() { /* TODO: free memory! */ }
 
         string current_state();
-    private:
+    protected:
         void resample_posterior();
-        void resample_posterior_z_for(unsigned d, bool remove);
+        void resample_posterior_z_for(unsigned d, bool remove) {
+            (this->*_z_kernel)(d, remove);
+        }
+
+        // Level resampling specialized on the depth (kL = 0 means use _L at
+        // runtime) and on ncrp_skip_root, so that the per-token loop over
+        // levels can be fully unrolled for the common shallow trees.
+        template <unsigned kL, bool kSkipRoot>
+        void resample_posterior_z_kernel(unsigned d, bool remove);
+
+        typedef void (FixedDepthNCRP::*LevelKernel)(unsigned, bool);
+        template <bool kSkipRoot>
+        LevelKernel select_level_kernel();
 
         double compute_log_likelihood();
+
+        // Recomputes the log likelihood components from the counts
+        void compute_exact_log_likelihood();
+
+        // Incremental log likelihood updates. A path move is bracketed by
+        // begin_path_move / finish_path_move; a level move is applied just
+        // before the token is added back, using the counts with it removed.
+        void begin_path_move(unsigned d);
+        void finish_path_move(unsigned d);
+        void track_level_move(unsigned w, unsigned d,
+                unsigned z_old, unsigned nd_old,
+                unsigned z_new, unsigned nd_new);
+
+        // Log likelihood of the tree structure attributable to node, given its
+        // number of documents and tables
+        double node_tree_log_likelihood(CRP* node, unsigned ndsum, unsigned tables);
+        double node_tree_log_likelihood(CRP* node) {
+            return node_tree_log_likelihood(node, node->ndsum, node->tables.size());
+        }
+
+    protected:
+        LevelKernel _z_kernel;  // selected from _L and the flags at startup
+
+        // Scratch space for the runtime-depth kernel
+        vector<double> _lp_z_dn;
+        vector<unsigned> _nd_l;
+
+        // Components of the log likelihood: tree structure, words given
+        // topics and topics given documents
+        double _ll_tree;
+        double _ll_words;
+        double _ll_docs;
+        bool _ll_valid;  // are the components in sync with the counts?
+        int _ll_exact_iter;  // iteration of the last exact recompute
+
+        // State of the path move in progress
+        vector<CRP*> _old_path;
+        unsigned _old_first_collected;  // first level that will be collected
+        double _old_tree_ll;
+};
+
+// Flat Dirichlet process mixture engine for --ncrp_depth=2 --ncrp_skip_root.
+// In that configuration the root never holds any words and every leaf is just
+// a DP cluster, so instead of walking the tree we keep a compact word
+// histogram per document and score it against every leaf (root->tables) in a
+// single pass. The tree itself is still maintained so that the output and log
+// likelihood code is shared with FixedDepthNCRP.
+class FlatDPMixtureNCRP : public FixedDepthNCRP {
+    public:
+        FlatDPMixtureNCRP();
+
+        // True if the flags describe a configuration this engine can run
+        static bool applies();
+
+        void allocate_document(unsigned d);
+
+    protected:
+        void resample_posterior();
+        void resample_posterior_z_for(unsigned d, bool remove);
+        void resample_posterior_c_for(unsigned d);
+
+        // A document's word histogram along with the log data likelihood of
+        // starting a brand new cluster with it
+        struct DocumentHistogram : public WordHistogram {
+            double lp_new_cluster;
+        };
+        const DocumentHistogram& histogram_for(unsigned d);
+
+        // Move all of d's words in or out of a cluster
+        void add_document_to(CRP* cluster, unsigned d, const WordHistogram& h);
+        void remove_document_from(CRP* cluster, unsigned d, const WordHistogram& h);
+
+        // Each leaf also keeps its counts in a dense slab (a row of word
+        // counts plus its nwsum and ndsum), so scoring a document against a
+        // leaf reads arrays instead of probing nw once per word. The slabs
+        // follow add_document_to/remove_document_from; slots of collected
+        // leaves are reused.
+        unsigned slot_for(CRP* cluster);
+        void release_slot(CRP* cluster);
+        void update_slab(CRP* cluster, const WordHistogram& h, int sign);
+        void grow_slabs();  // widen every slab to the vocabulary size
+
+    protected:
+        google::dense_hash_map<unsigned, DocumentHistogram> _histogram;
+
+        map<CRP*, unsigned> _slot;  // leaf -> slab slot
+        vector<vector<unsigned> > _slab_nw;  // per slot, indexed by word
+        vector<unsigned> _slab_nwsum;
+        vector<unsigned> _slab_ndsum;
+        vector<unsigned> _free_slots;
+        unsigned _slab_width;  // length of every row of _slab_nw
+        vector<unsigned> _table_slots;  // scratch: slot of each root->tables[k]
+
+        double _eta_scale;  // eta_depth_scale at the leaf level
+
+        vector<double> _lp_cluster;  // scratch space for the cluster scores
 };
 
 #endif  // SAMPLE_MULT_NCRP_H_
@@ -40,6 +40,16 @@ DEFINE_bool(cull_unique_topics,
             true,
             "should we cull topics that only have one document?");
 
+// Color classes smaller than this many documents per thread are sampled
+// serially; spinning up the workers isn't worth it for them
+const unsigned kMinDocsPerWorker = 16;
+
+NCRPPrecomputedFixed::~NCRPPrecomputedFixed() {
+    for (int t = 0; t < _worker_random.size(); t++) {
+        delete_thread_random(_worker_random[t]);
+    }
+}
+
 void NCRPPrecomputedFixed::add_crp_node(const string& name) {
     if (_node_to_crp.find(name) == _node_to_crp.end()) {
         // havent made a CRP node for this yet
@@ -47,13 +57,43 @@ void NCRPPrecomputedFixed::add_crp_node(const string& name) {
         _node_to_crp[name]->label = name;
         CHECK_EQ(_node_to_crp[name]->prev.size(), 0);
         VLOG(1) << "creating node [" << name << "]";
-        _unique_nodes += 1;
+        _stats.add_node(0);
+    }
+}
+
+// Names parse_topic_assignments_file in the structure cache header
+const char kTopicAssignmentsParser[] = "topic-assignments";
+
+// Reads document <tab> topic <tab> topic ... lines
+static void parse_topic_assignments_file(const string& filename, ParsedStructureFile* topics) {
+    ifstream input_file(filename.c_str(), ios_base::in | ios_base::binary);
+
+    string curr_line;
+    while (true) {
+        getline(input_file, curr_line);
+
+        if (input_file.eof()) {
+            break;
+        }
+        vector<string> tokens;
+        curr_line = StringReplace(curr_line, "\n", "", true);
+
+        // LOG(INFO) << curr_line;
+        SplitStringUsing(curr_line, "\t", &tokens);
+
+        vector<unsigned> row;
+        for (int i = 0; i < tokens.size(); i++) {
+            row.push_back(topics->index_of(tokens[i]));
+        }
+        topics->rows.push_back(row);
+        topics->has_weight.push_back(false);
+        topics->weights.push_back(0);
     }
 }
 
 void NCRPPrecomputedFixed::load_precomputed_tree_structure(const string& filename) {
     LOG(INFO) << "loading tree";
-    _unique_nodes = 0;
+    _stats = TreeStats();
     _node_to_crp.set_empty_key(kEmptyStringKey);
 
     CHECK(!FLAGS_ncrp_skip_root);
@@ -67,41 +107,43 @@ void NCRPPrecomputedFixed::load_precomputed_tree_structure(const string& filenam
     CHECK(!FLAGS_learn_eta);
     CHECK(!FLAGS_gem_sampler);
 
-    ifstream input_file(filename.c_str(), ios_base::in | ios_base::binary);
+    ParsedStructureFile topics;
+    load_structure_file(filename, kTopicAssignmentsParser, parse_topic_assignments_file, &topics);
 
     // First add in the noise topics
+    _noise_topics.clear();
+    _noise_index.clear();
     for (int i = 0; i < FLAGS_additional_noise_topics; i++) {
-        add_crp_node(StringPrintf("NOISE_%d", i));
+        string name = StringPrintf("NOISE_%d", i);
+        add_crp_node(name);
+        _noise_index[_node_to_crp[name]] = _noise_topics.size();
+        _noise_topics.push_back(_node_to_crp[name]);
     }
 
-    // First pass over the entire tree structure and create CRP nodes for each
-    // of the unique node names
-    string curr_line;
-    while (true) {
-        getline(input_file, curr_line);
-
-        if (input_file.eof()) {
-            break;
+    // Pass over the entire tree structure and create CRP nodes for each of
+    // the unique node names
+    vector<CRP*> nodes(topics.names.size(), NULL);  // by name index, once created
+    for (int r = 0; r < topics.rows.size(); r++) {
+        const vector<unsigned>& row = topics.rows[r];
+        if (row.empty()) {
+            continue;
         }
-        vector<string> tokens;
-        curr_line = StringReplace(curr_line, "\n", "", true);
-
-        // LOG(INFO) << curr_line;
-        SplitStringUsing(curr_line, "\t", &tokens);
-
-        string doc_name = tokens[0];
+        const string& doc_name = topics.names[row[0]];
 
         if (_document_id.find(doc_name) != _document_id.end()) {
             // Add new nodes for each unseen topic and then build the _c vector for
             // the document, if necessary (adds a node specific to the document
             // as well)
-            for (int i = 0; i < tokens.size(); i++) {
-                add_crp_node(tokens.at(i));
+            for (int i = 0; i < row.size(); i++) {
+                if (!nodes[row[i]]) {
+                    add_crp_node(topics.names[row[i]]);
+                    nodes[row[i]] = _node_to_crp[topics.names[row[i]]];
+                }
             }
             // Build the _c vector
             unsigned d = _document_id[doc_name];
-            for (int i = 1; i < tokens.size(); i++) {
-                _c[d].push_back(_node_to_crp[tokens[i]]);
+            for (int i = 1; i < row.size(); i++) {
+                _c[d].push_back(nodes[row[i]]);
             }
             // Add in the noise topics
             for (int i = 0; i < FLAGS_additional_noise_topics; i++) {
@@ -229,6 +271,230 @@ void NCRPPrecomputedFixed::batch_allocation() {
     write_dictionary();
 }
 
+void NCRPPrecomputedFixed::resample_posterior() {
+    if (FLAGS_threads <= 1) {
+        GEMNCRPFixed::resample_posterior();
+        return;
+    }
+
+    CHECK_GT(_lV, 0);
+    CHECK_GT(_lD, 0);
+    CHECK_GT(_L, 0);
+
+    // The label assignments are fixed, so the coloring only has to be built
+    // once
+    if (_color_classes.empty()) {
+        build_label_coloring();
+    }
+
+    for (int c = 0; c < _color_classes.size(); c++) {
+        resample_color_class(_color_classes[c]);
+    }
+}
+
+// Two documents conflict if they share a label topic (the noise topics are
+// shared by everything and are handled with per-worker deltas instead). Rather
+// than materializing the conflict graph, each topic remembers which colors its
+// documents already took and each document gets the smallest color free at
+// all of its topics.
+void NCRPPrecomputedFixed::build_label_coloring() {
+    _color_classes.clear();
+
+    map<CRP*, vector<bool> > used;  // colors already taken at each topic
+    unsigned colored = 0;
+    for (DocumentMap::const_iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
+        unsigned d = d_itr->first;
+        const vector<CRP*>& cd = _c[d];
+        if (cd.empty()) {
+            continue;
+        }
+
+        vector<bool> taken(_color_classes.size(), false);
+        for (int l = 0; l < cd.size(); l++) {
+            if (_noise_index.find(cd[l]) != _noise_index.end()) {
+                continue;
+            }
+            const vector<bool>& u = used[cd[l]];
+            for (int c = 0; c < u.size(); c++) {
+                if (u[c]) {
+                    taken[c] = true;
+                }
+            }
+        }
+
+        unsigned color = 0;
+        while (color < taken.size() && taken[color]) {
+            color += 1;
+        }
+        if (color == _color_classes.size()) {
+            _color_classes.push_back(vector<unsigned>());
+        }
+        _color_classes[color].push_back(d);
+        colored += 1;
+
+        for (int l = 0; l < cd.size(); l++) {
+            if (_noise_index.find(cd[l]) != _noise_index.end()) {
+                continue;
+            }
+            vector<bool>& u = used[cd[l]];
+            if (u.size() <= color) {
+                u.resize(color+1, false);
+            }
+            u[color] = true;
+        }
+    }
+    LOG(INFO) << "colored " << colored << " documents with "
+              << _color_classes.size() << " colors";
+}
+
+void NCRPPrecomputedFixed::resample_color_class(const vector<unsigned>& docs) {
+    unsigned threads = FLAGS_threads;
+
+    if (docs.size() < kMinDocsPerWorker * threads) {
+        for (int i = 0; i < docs.size(); i++) {
+            resample_posterior_z_for(docs[i], true);
+        }
+        return;
+    }
+
+    // Set up the per-slice generators and deltas the first time through
+    if (_worker_random.size() != threads) {
+        for (int t = 0; t < _worker_random.size(); t++) {
+            delete_thread_random(_worker_random[t]);
+        }
+        _worker_random.clear();
+        _worker_delta.resize(threads);
+        for (int t = 0; t < threads; t++) {
+            _worker_random.push_back(new_thread_random(FLAGS_random_seed + t + 1));
+            _worker_delta[t].nw.resize(_noise_topics.size());
+            for (int j = 0; j < _noise_topics.size(); j++) {
+                _worker_delta[t].nw[j].set_empty_key(kEmptyUnsignedKey);
+            }
+            _worker_delta[t].nwsum.assign(_noise_topics.size(), 0);
+        }
+    }
+
+    // One task per slice of the class, each with its own generator and delta
+    _color_docs = &docs;
+    run_parallel_tasks(threads, resample_color_slice_task, this, _worker_random);
+    _color_docs = NULL;
+
+    // Fold the noise topic deltas back into the shared nodes
+    for (int t = 0; t < threads; t++) {
+        NoiseTopicDelta& delta = _worker_delta[t];
+        for (int j = 0; j < _noise_topics.size(); j++) {
+            CRP* node = _noise_topics[j];
+            for (google::dense_hash_map<unsigned, int>::iterator itr = delta.nw[j].begin();
+                    itr != delta.nw[j].end(); itr++) {
+                if (itr->second != 0) {
+                    node->nw[itr->first] += itr->second;
+                }
+            }
+            node->nwsum += delta.nwsum[j];
+            delta.nw[j].clear();
+            delta.nwsum[j] = 0;
+        }
+        for (int i = 0; i < delta.nd.size(); i++) {
+            delta.nd[i].first->nd[delta.nd[i].second.first] = delta.nd[i].second.second;
+        }
+        delta.nd.clear();
+    }
+}
+
+void NCRPPrecomputedFixed::resample_color_slice(unsigned t) {
+    const vector<unsigned>& docs = *_color_docs;
+    unsigned slices = _worker_delta.size();
+    unsigned end = docs.size() * (t+1) / slices;
+    for (unsigned i = docs.size() * t / slices; i < end; i++) {
+        resample_posterior_z_for_worker(docs[i], &_worker_delta[t]);
+    }
+}
+
+void NCRPPrecomputedFixed::resample_color_slice_task(void* context, unsigned t) {
+    ((NCRPPrecomputedFixed*)context)->resample_color_slice(t);
+}
+
+// Same as the multinomial branch of GEMNCRPFixed::resample_posterior_z_for,
+// except that it only touches state owned by this document's color: the label
+// topics are exclusive to the worker, while noise topic reads see the shared
+// counts from the start of the phase plus this worker's own changes. The
+// shared document maps are only read through find so that nothing rehashes
+// under the other workers.
+void NCRPPrecomputedFixed::resample_posterior_z_for_worker(unsigned d, NoiseTopicDelta* delta) {
+    const vector<unsigned>& words = _D.find(d)->second;
+    const vector<CRP*>& cd = _c.find(d)->second;
+    WordToCountMap& zd = _z.find(d)->second;
+    unsigned L = cd.size();
+    LevelScoringContext& ctx = delta->context;
+    begin_level_context(d, cd, &ctx);
+
+    // Which noise topic each level is (-1 for labels); the noise levels'
+    // totals include this worker's pending changes
+    vector<int> noise(L, -1);
+    for (int l = 0; l < L; l++) {
+        map<CRP*, unsigned>::const_iterator n_itr = _noise_index.find(cd[l]);
+        if (n_itr != _noise_index.end()) {
+            noise[l] = n_itr->second;
+            update_level_context(l, cd[l]->nwsum + delta->nwsum[noise[l]], &ctx);
+        }
+    }
+
+    for (int n = 0; n < words.size(); n++) {  // loop over every word
+        unsigned w = words[n];
+        unsigned z = zd[n];
+
+        // Remove this word from the counts
+        ctx.nd[z] -= 1;
+        if (noise[z] >= 0) {
+            delta->nw[noise[z]][w] -= 1;
+            delta->nwsum[noise[z]] -= 1;
+            update_level_context(z, cd[z]->nwsum + delta->nwsum[noise[z]], &ctx);
+        } else {
+            cd[z]->nw[w] -= 1;
+            cd[z]->nwsum -= 1;
+            update_level_context(z, cd[z]->nwsum, &ctx);
+        }
+
+        for (int l = 0; l < L; l++) {
+            WordToCountMap::const_iterator nw_itr = cd[l]->nw.find(w);
+            ctx.nw[l] = (nw_itr == cd[l]->nw.end()) ? 0 : nw_itr->second;
+            if (noise[l] >= 0) {
+                google::dense_hash_map<unsigned, int>::const_iterator dw_itr
+                    = delta->nw[noise[l]].find(w);
+                if (dw_itr != delta->nw[noise[l]].end()) {
+                    ctx.nw[l] += dw_itr->second;
+                }
+            }
+        }
+        score_levels(w, &ctx);
+
+        // Update the assignment
+        z = sample_unnormalized_log_multinomial(&ctx.scores[0], L);
+        CHECK_LT(z, L);
+        zd[n] = z;
+
+        // Update the counts
+        ctx.nd[z] += 1;
+        if (noise[z] >= 0) {
+            delta->nw[noise[z]][w] += 1;
+            delta->nwsum[noise[z]] += 1;
+            update_level_context(z, cd[z]->nwsum + delta->nwsum[noise[z]], &ctx);
+        } else {
+            cd[z]->nw[w] += 1;
+            cd[z]->nwsum += 1;
+            update_level_context(z, cd[z]->nwsum, &ctx);
+        }
+    }
+
+    // Write back the per-document topic counts
+    for (int l = 0; l < L; l++) {
+        if (noise[l] >= 0) {
+            delta->nd.push_back(make_pair(cd[l], make_pair(d, ctx.nd[l])));
+        } else {
+            cd[l]->nd[d] = ctx.nd[l];
+        }
+    }
+}
 
 // Write out a static dictionary required for decoding Gibbs samples
 void NCRPPrecomputedFixed::write_dictionary() {
@@ -19,6 +19,7 @@
 #ifndef SAMPLE_PRECOMPUTED_FIXED_NCRP_H_
 #define SAMPLE_PRECOMPUTED_FIXED_NCRP_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -35,11 +36,24 @@ DECLARE_int32(additional_noise_topics);
 // Should we cull topics that only have one document?
 DECLARE_bool(cull_unique_topics);
 
+// Noise topic count changes made by one worker thread during a parallel color
+// phase. The noise topics are shared by every document, so they are only
+// updated once all the workers in the phase have finished.
+struct NoiseTopicDelta {
+    vector<google::dense_hash_map<unsigned, int> > nw;  // per noise topic
+    vector<int> nwsum;
+    vector<pair<CRP*, pair<unsigned, unsigned> > > nd;  // (node, (d, nd[d]))
+
+    LevelScoringContext context;  // the worker's own level scoring scratch
+};
+
 // This version differs from the normal GEM sampler in that the tree structure
 // is fixed a priori. Hence there is no resampling of c, the path allocations.
 class NCRPPrecomputedFixed : public GEMNCRPFixed {
     public:
-        NCRPPrecomputedFixed(double m, double pi) : GEMNCRPFixed(m, pi) { }
+        NCRPPrecomputedFixed(double m, double pi)
+            : GEMNCRPFixed(m, pi), _color_docs(NULL) { }
+        ~NCRPPrecomputedFixed();
 
         // Load the tree structure
         void load_precomputed_tree_structure(const string& filename);
@@ -59,9 +73,40 @@ class NCRPPrecomputedFixed : public GEMNCRPFixed {
     protected:
         void add_crp_node(const string& name);
 
+        // With --threads > 1, documents that share no label topics are
+        // sampled concurrently
+        void resample_posterior();
+
+        // Greedily colors the documents so that no two documents of the same
+        // color share a (non-noise) topic
+        void build_label_coloring();
+
+        // Samples all the documents of one color across the worker threads and
+        // then folds the noise topic deltas back in
+        void resample_color_class(const vector<unsigned>& docs);
+
+        // Level resampling for d run by worker thread; noise topic counts go
+        // to delta instead of the shared nodes
+        void resample_posterior_z_for_worker(unsigned d, NoiseTopicDelta* delta);
+
+        // Samples slice t of the color class being resampled into
+        // _worker_delta[t]; run as a parallel task
+        void resample_color_slice(unsigned t);
+        static void resample_color_slice_task(void* context, unsigned t);
+
     protected:
           google::dense_hash_map<string, CRP*> _node_to_crp;
 
+          vector<CRP*> _noise_topics;
+          map<CRP*, unsigned> _noise_index;  // noise topic -> index in _noise_topics
+
+          vector< vector<unsigned> > _color_classes;  // documents by color
+
+          // Per-slice generators and noise topic deltas for the color phases
+          vector<ThreadRandom*> _worker_random;
+          vector<NoiseTopicDelta> _worker_delta;
+          const vector<unsigned>* _color_docs;  // class being resampled
+
           unsigned _total;  // number of total documents on load
           unsigned _missing;  // number of missing documents on load
 };
@@ -76,11 +76,18 @@ DEFINE_string(cc_fixed_topic_seed,
 const string kNormalModel = "normal";
 const string kMarginalModel = "marginal";
 
+SoftCrossCatMM::~SoftCrossCatMM() {
+    for (int m = 0; m < _view_random.size(); m++) {
+        delete_thread_random(_view_random[m]);
+    }
+}
+
 void SoftCrossCatMM::clean_initialization() {
     _iter = _best_iter = 0;
     // Keep track of the number of clusters in each view
     _current_component.clear();
     _current_component.resize(FLAGS_M);
+    reset_view_statistics();
 
     // Allocate the initial clusters
     _cluster.clear();
@@ -128,6 +135,9 @@ void SoftCrossCatMM::batch_allocation() {
     _cluster_marginal.set_empty_key(kEmptyUnsignedKey);
     _cluster_marginal.set_deleted_key(kDeletedUnsignedKey);
 
+    _view_scorer.resize(FLAGS_M);
+    _view_scores.resize(FLAGS_M);
+
     if (FLAGS_cc_resume_from_best && restore_data_from_prefix("last")) {
         LOG(WARNING) << "restored from last, not best";
         return;
@@ -171,6 +181,9 @@ void SoftCrossCatMM::batch_allocation() {
             // views
             _cluster[zdn][cdm].add_no_ndsum(w, d);
             _cluster_marginal[zdn].add_no_ndsum(w, d);
+            if (_cluster_marginal[zdn].nd[d] == 1) {  // first word in this view
+                _cluster[zdn][cdm].nonzero_ndsum += 1;
+            }
         }
         
         if (d > 0) {
@@ -187,161 +200,331 @@ void SoftCrossCatMM::batch_allocation() {
             LOG(INFO) << "Sorted " << d << " documents into " << FLAGS_M << " views, sized: " << cluster_sizes;
         }
     }
+    collect_view_statistics();
     
     _ll = compute_log_likelihood();
     
 }
 
+void SoftCrossCatMM::reset_view_statistics() {
+    _view_c_proposed.assign(FLAGS_M, 0);
+    _view_c_failed.assign(FLAGS_M, 0);
+    _view_log_lik.assign(FLAGS_M, 0);
+    _view_split_merge.assign(FLAGS_M, SplitMergeStats());
+}
+
+void SoftCrossCatMM::collect_view_statistics() {
+    _c_proposed = _c_failed = 0;
+    _temp_log_lik = 0;
+    _split_merge = SplitMergeStats();
+    for (int m = 0; m < FLAGS_M; m++) {
+        _c_proposed += _view_c_proposed[m];
+        _c_failed += _view_c_failed[m];
+        _temp_log_lik += _view_log_lik[m];
+        _split_merge.add(_view_split_merge[m]);
+    }
+}
+
 // Performs a single document's level assignment resample step
 void SoftCrossCatMM::resample_posterior_c_for(unsigned d) {
     for (int m = 0; m < FLAGS_M; m++) {
-        unsigned old_cdm = _c[d][m];
+        resample_posterior_c_for(d, m);
+    }
+}
 
-        unsigned total_removed_count = 0;
-        google::dense_hash_map<unsigned, unsigned> removed_w;
-        removed_w.set_empty_key(kEmptyUnsignedKey);
-        
-        // Remove this document from this clustering
-        for (int n = 0; n < _D[d].size(); n++) {
-            if (_z[d][n] == m) {
-                unsigned w = _D[d][n];
-                total_removed_count += 1;
-                removed_w[w] += 1;
-                // Remove this document and word from the counts
-                _cluster[m][old_cdm].nw[w] -= 1;  // # of words in cluster c view m
-                _cluster[m][old_cdm].nwsum -= 1;  // # of words in cluster c
-                _cluster_marginal[m].nw[w] -= 1;
-                _cluster_marginal[m].nwsum -= 1;
-                CHECK_GE(_cluster[m][old_cdm].nw[w], 0);
-                CHECK_GE(_cluster_marginal[m].nw[w], 0);
-            }
-        }
+// Looks up key in one of the per-document maps (_c[d] or _z[d]). These are
+// filled in completely before sampling starts and are shared by the per-view
+// tasks, so the sampling code must never insert into them.
+static unsigned& existing_entry(cluster_map& map, unsigned key) {
+    cluster_map::iterator itr = map.find(key);
+    CHECK(itr != map.end()) << "missing entry " << key;
+    return itr->second;
+}
 
-        // Skip the resample if we didn't remove anything
-        if (total_removed_count == 0) {
-            continue;
+// Resamples document d's cluster in view m. Only touches view m's state, so
+// different views can be resampled at once.
+void SoftCrossCatMM::resample_posterior_c_for(unsigned d, unsigned m) {
+    const Document& doc = _D.find(d)->second;
+    cluster_map& cd = _c.find(d)->second;
+    cluster_map& zd = _z.find(d)->second;
+    clustering& cm = _cluster.find(m)->second;
+    CRP& marginal = _cluster_marginal.find(m)->second;
+
+    unsigned& cdm = existing_entry(cd, m);
+    unsigned old_cdm = cdm;
+
+    unsigned total_removed_count = 0;
+    google::dense_hash_map<unsigned, unsigned> removed_w;
+    removed_w.set_empty_key(kEmptyUnsignedKey);
+    
+    // Remove this document from this clustering
+    for (int n = 0; n < doc.size(); n++) {
+        if (existing_entry(zd, n) == m) {
+            unsigned w = doc[n];
+            total_removed_count += 1;
+            removed_w[w] += 1;
+            // Remove this document and word from the counts
+            cm[old_cdm].nw[w] -= 1;  // # of words in cluster c view m
+            cm[old_cdm].nwsum -= 1;  // # of words in cluster c
+            marginal.nw[w] -= 1;
+            marginal.nwsum -= 1;
+            CHECK_GE(cm[old_cdm].nw[w], 0);
+            CHECK_GE(marginal.nw[w], 0);
         }
+    }
 
+    // Skip the resample if we didn't remove anything
+    if (total_removed_count == 0) {
+        return;
+    }
 
-        CHECK_GT(_cluster[m][old_cdm].ndsum, 0);
 
-        _cluster[m][old_cdm].ndsum -= 1;  // # of docs in clsuter
-        _cluster_marginal[m].ndsum -= 1;
+    CHECK_GT(cm[old_cdm].ndsum, 0);
 
-        CHECK_GE(_cluster[m][old_cdm].nwsum, 0);
-        CHECK_LT(_cluster[m][old_cdm].ndsum, _lD);
+    cm[old_cdm].ndsum -= 1;  // # of docs in clsuter
+    cm[old_cdm].nonzero_ndsum -= 1;  // d has words in this view
+    marginal.ndsum -= 1;
 
-        // Compute the log likelihood of each cluster assignment given all the other
-        // document-cluster assignments
-        
-        // This is essentially Radford Neal's Algorithm 3, check out Mark Johnson's notes: http://cog.brown.edu/~mj/classes/cg168/slides/ChineseRestaurants.pdf
-        vector<sampler_entry> lp_z_d;
-        for (clustering::iterator itr = _cluster[m].begin();
-                itr != _cluster[m].end();
-                itr++) {
-            unsigned l = itr->first;
+    CHECK_GE(cm[old_cdm].nwsum, 0);
+    CHECK_LT(cm[old_cdm].ndsum, _lD);
 
-            double sum = 0;
-            
-            // First add in the prior over the clusters
-            // XXX: OLD (correct version)
-            // sum += log(_cluster[m][l].ndsum) - log(_lD - 1 + FLAGS_mm_alpha);
-            // NEW: might not work when topic switching is allowed
-            sum += log(_cluster[m][l].ndsum) - log(_cluster_marginal[m].ndsum - 1 + FLAGS_mm_alpha);
-
-            // Add in the normalizer for the multinomial-dirichlet likelihood
-            sum += gammaln(_eta_sum + _cluster[m][l].nwsum) - gammaln(_eta_sum + _cluster[m][l].nwsum + total_removed_count);
-
-            // Now account for the likelihood of the data (marginal posterior of
-            // DP-Mult); only need to loop over what was actually removed since
-            // other stuff (removed_w = 0) ends up canceling the two gammalns
-            for (google::dense_hash_map<unsigned,unsigned>::iterator itr = removed_w.begin();
-                    itr != removed_w.end();
-                    itr++) {
-                unsigned w = itr->first;
-                unsigned count = itr->second;
-                sum += gammaln(_eta[w] + count + _cluster[m][l].nw[w]) - gammaln(_eta[w] + _cluster[m][l].nw[w]);
-            }
-            lp_z_d.push_back(sampler_entry(l, sum));
-        }
+    // Compute the log likelihood of each cluster assignment given all the other
+    // document-cluster assignments
+    
+    // This is essentially Radford Neal's Algorithm 3, check out Mark Johnson's notes: http://cog.brown.edu/~mj/classes/cg168/slides/ChineseRestaurants.pdf
+    //
+    // Only need to score what was actually removed since other stuff
+    // (removed_w = 0) ends up canceling the two gammalns
+    feature_counts removed;
+    for (google::dense_hash_map<unsigned,unsigned>::iterator itr = removed_w.begin();
+            itr != removed_w.end();
+            itr++) {
+        removed.push_back(*itr);
+    }
+    MixtureScorer& scorer = _view_scorer[m];
+    scorer.load(cm);
+    double new_cluster_score = scorer.score(removed, total_removed_count,
+            _eta, _eta_sum, &_view_scores[m]);
+    const vector<double>& scores = _view_scores[m];
+
+    vector<sampler_entry> lp_z_d;
+    for (int k = 0; k < scorer.size(); k++) {
+        // First add in the prior over the clusters
+        // XXX: OLD (correct version)
+        // sum += log(cm[l].ndsum) - log(_lD - 1 + FLAGS_mm_alpha);
+        // NEW: might not work when topic switching is allowed
+        double sum = log(scorer.ndsum(k)) - log(marginal.ndsum - 1 + FLAGS_mm_alpha);
+
+        // Multinomial-dirichlet likelihood of the data (marginal posterior of
+        // DP-Mult)
+        sum += scores[k];
+        lp_z_d.push_back(sampler_entry(scorer.id(k), sum));
+    }
 
 
-        // Add an additional new component if not in the noise view, we haven't
-        // hit KMAX, and this isn't a singleton cluster already
-        if (_cluster[m][old_cdm].ndsum > 0) {
-            if (_cluster[m].size() < FLAGS_KMAX || FLAGS_KMAX==-1) {
-                if (m != 0 || !FLAGS_cc_include_noise_view) {
-                    double sum = 0;
-                    // sum += log(FLAGS_mm_alpha) - log(_lD - 1 + FLAGS_mm_alpha);
-                    sum += log(FLAGS_mm_alpha) - log(_cluster_marginal[m].ndsum - 1 + FLAGS_mm_alpha);
-
-                    // Add in the normalizer for the multinomial-dirichlet likelihood
-                    sum += gammaln(_eta_sum) - gammaln(_eta_sum + total_removed_count);
-                    for (google::dense_hash_map<unsigned,unsigned>::iterator itr = removed_w.begin();
-                            itr != removed_w.end();
-                            itr++) {
-                        unsigned w = itr->first;
-                        unsigned count = itr->second;
-                        sum += gammaln(_eta[w] + count) - gammaln(_eta[w]);
-                    }
-                    lp_z_d.push_back(sampler_entry(_current_component[m], sum));
-                }
+    // Add an additional new component if not in the noise view, we haven't
+    // hit KMAX, and this isn't a singleton cluster already
+    if (cm[old_cdm].ndsum > 0) {
+        if (cm.size() < FLAGS_KMAX || FLAGS_KMAX==-1) {
+            if (m != 0 || !FLAGS_cc_include_noise_view) {
+                // sum += log(FLAGS_mm_alpha) - log(_lD - 1 + FLAGS_mm_alpha);
+                double sum = log(FLAGS_mm_alpha) - log(marginal.ndsum - 1 + FLAGS_mm_alpha);
+                sum += new_cluster_score;
+                lp_z_d.push_back(sampler_entry(_current_component[m], sum));
             }
         }
+    }
 
-        // Update the assignment
-        sampler_entry x = NEW_sample_unnormalized_log_multinomial(&lp_z_d);
-        _c[d][m] = x.index;
-        VLOG(1) << "resampling posterior c for " << d << "," << m << ": " << old_cdm << "->" << _c[d][m];
-
-        // Add in the probability of selecting that cluster
-        // LOG(INFO) << x.score;
-        /*if (x.score == 1.0) {
-            LOG(INFO) << "ONE";
-            for (int i = 0; i < lp_z_d.size(); i++) {
-                LOG(INFO) << lp_z_d.at(i).index << " " << lp_z_d.at(i).score;
-            }
-        }*/
-        CHECK_GT(x.score, 0);
-        _temp_log_lik += log(x.score);
+    // Update the assignment
+    sampler_entry x = NEW_sample_unnormalized_log_multinomial(&lp_z_d);
+    cdm = x.index;
+    VLOG(1) << "resampling posterior c for " << d << "," << m << ": " << old_cdm << "->" << cdm;
+
+    // Add in the probability of selecting that cluster
+    // LOG(INFO) << x.score;
+    /*if (x.score == 1.0) {
+        LOG(INFO) << "ONE";
+        for (int i = 0; i < lp_z_d.size(); i++) {
+            LOG(INFO) << lp_z_d.at(i).index << " " << lp_z_d.at(i).score;
+        }
+    }*/
+    CHECK_GT(x.score, 0);
+    _view_log_lik[m] += log(x.score);
+
+    unsigned new_cdm = cdm;
+
+    if (new_cdm == old_cdm) {
+        _view_c_failed[m] += 1;
+    }
+    _view_c_proposed[m] += 1;
+
+    // Update the counts
+    for (google::dense_hash_map<unsigned,unsigned>::iterator itr = removed_w.begin();
+            itr != removed_w.end();
+            itr++) {
+        unsigned w = itr->first;
+        unsigned count = itr->second;
+        cm[new_cdm].nw[w] += count;  // number of words in topic z equal to w
+        marginal.nw[w] += count;  // number of words in topic z equal to w
+    }
+    cm[new_cdm].nwsum += total_removed_count;  // number of words in topic z
+    cm[new_cdm].ndsum += 1;  // number of words in doc d with topic z
+    cm[new_cdm].nonzero_ndsum += 1;
+
+    marginal.nwsum += total_removed_count;  // number of words in topic z
+    marginal.ndsum += 1;  // number of words in doc d with topic z
+
+    CHECK_LE(cm[new_cdm].ndsum, _lD);
 
-        unsigned new_cdm = _c[d][m];
+    // Clean up for the DPSoftCrossCatMM
+    if (cm[old_cdm].ndsum == 0) {  // empty component
+        // LOG(INFO) << "removing cluster " << old_zdm << " from view "  << m << " because we chose cluster " << new_zdm;
+        // _c.erase(old_zdm);
+        cm.erase(old_cdm);
+    }
+    // Make room for a new component if we selected the new one
+    if (new_cdm == _current_component[m]) {
+        _current_component[m] += 1;
+    }
+}
+
+// Resamples every document's cluster in view m
+void SoftCrossCatMM::resample_posterior_c_view(unsigned m) {
+    for (int d = 0; d < _D.size(); d++) {
+        resample_posterior_c_for(d, m);
+    }
+    resample_split_merge_view(m);
+}
 
-        if (new_cdm == old_cdm) {
-            _c_failed += 1;
+// Collapses the words of document d assigned to view m, returning how many
+// there are
+unsigned SoftCrossCatMM::view_slice(unsigned d, unsigned m, feature_counts* slice) {
+    const Document& doc = _D.find(d)->second;
+    cluster_map& zd = _z.find(d)->second;
+
+    map<unsigned, unsigned> counts;
+    unsigned total = 0;
+    for (int n = 0; n < doc.size(); n++) {
+        if (existing_entry(zd, n) == m) {
+            counts[doc[n]] += 1;
+            total += 1;
         }
-        _c_proposed += 1;
+    }
+    slice->assign(counts.begin(), counts.end());
+    return total;
+}
 
-        // Update the counts
-        for (google::dense_hash_map<unsigned,unsigned>::iterator itr = removed_w.begin();
-                itr != removed_w.end();
-                itr++) {
-            unsigned w = itr->first;
-            unsigned count = itr->second;
-            _cluster[m][new_cdm].nw[w] += count;  // number of words in topic z equal to w
-            _cluster_marginal[m].nw[w] += count;  // number of words in topic z equal to w
+// Moves document d (whose words in view m are slice) to cluster new_cdm in
+// view m, dropping its old cluster if that leaves it empty
+void SoftCrossCatMM::move_to_cluster(unsigned d, unsigned m, unsigned new_cdm,
+        const feature_counts& slice, unsigned total) {
+    clustering& cm = _cluster.find(m)->second;
+    unsigned& cdm = existing_entry(_c.find(d)->second, m);
+
+    CRP& old_cluster = cm[cdm];
+    for (int i = 0; i < slice.size(); i++) {
+        old_cluster.nw[slice[i].first] -= slice[i].second;
+    }
+    old_cluster.nwsum -= total;
+    old_cluster.ndsum -= 1;
+    if (total > 0) {
+        old_cluster.nonzero_ndsum -= 1;
+    }
+    if (old_cluster.ndsum == 0) {
+        cm.erase(cdm);
+    }
+
+    CRP& new_cluster = cm[new_cdm];
+    for (int i = 0; i < slice.size(); i++) {
+        new_cluster.nw[slice[i].first] += slice[i].second;
+    }
+    new_cluster.nwsum += total;
+    new_cluster.ndsum += 1;
+    if (total > 0) {
+        new_cluster.nonzero_ndsum += 1;
+    }
+
+    cdm = new_cdm;
+}
+
+// Makes this sweep's split-merge proposals in view m. Only touches view m's
+// state, like resample_posterior_c_for.
+void SoftCrossCatMM::resample_split_merge_view(unsigned m) {
+    if (!split_merge_enabled_for(m) || (m == 0 && FLAGS_cc_include_noise_view)
+            || _lD < 2) {
+        return;
+    }
+    clustering& cm = _cluster.find(m)->second;
+
+    unsigned proposals = split_merge_proposals(_lD);
+    if (proposals == 0) {
+        return;
+    }
+
+    // Index the clusters' documents once for the whole batch of proposals
+    ClusterMembers index;
+    for (int d = 0; d < _D.size(); d++) {
+        index.add(_c.find(d)->second.find(m)->second, d);
+    }
+
+    for (int p = 0; p < proposals; p++) {
+        // Pick the two anchors
+        unsigned i = sample_integer(_lD);
+        unsigned j = sample_integer(_lD - 1);
+        if (j >= i) {
+            j += 1;
         }
-        _cluster[m][new_cdm].nwsum += total_removed_count;  // number of words in topic z
-        _cluster[m][new_cdm].ndsum += 1;  // number of words in doc d with topic z
+        unsigned ci = existing_entry(_c.find(i)->second, m);
+        unsigned cj = existing_entry(_c.find(j)->second, m);
 
-        _cluster_marginal[m].nwsum += total_removed_count;  // number of words in topic z
-        _cluster_marginal[m].ndsum += 1;  // number of words in doc d with topic z
+        // Don't split past the cluster limit
+        if (ci == cj && FLAGS_KMAX != -1 && cm.size() >= FLAGS_KMAX) {
+            continue;
+        }
 
-        CHECK_LE(_cluster[m][new_cdm].ndsum, _lD);
+        // Gather up everything in the anchors' clusters
+        vector<unsigned> members;
+        index.gather(i, ci, j, cj, &members);
+        vector<feature_counts> slices(members.size());
+        vector<const feature_counts*> docs;
+        vector<unsigned> totals;
+        vector<unsigned> side;
+        for (int k = 0; k < members.size(); k++) {
+            unsigned d = members[k];
+            totals.push_back(view_slice(d, m, &slices[k]));
+            docs.push_back(&slices[k]);
+            side.push_back((ci != cj && existing_entry(_c.find(d)->second, m) == cj) ? 1 : 0);
+        }
 
-        // Clean up for the DPSoftCrossCatMM
-        if (_cluster[m][old_cdm].ndsum == 0) {  // empty component
-            // LOG(INFO) << "removing cluster " << old_zdm << " from view "  << m << " because we chose cluster " << new_zdm;
-            // _c.erase(old_zdm);
-            _cluster[m].erase(old_cdm);
+        if (!split_merge_move(docs, totals, FLAGS_mm_alpha, _eta, _eta_sum,
+                    &_view_scorer[m], &side, &_view_split_merge[m])) {
+            continue;
         }
-        // Make room for a new component if we selected the new one
-        if (new_cdm == _current_component[m]) {
+
+        index.apply(members, side, ci, cj, _current_component[m]);
+        if (ci == cj) {
+            // The documents on side 1 make up a brand new cluster
+            unsigned new_cdm = _current_component[m];
             _current_component[m] += 1;
+            for (int k = 0; k < members.size(); k++) {
+                if (side[k] == 1) {
+                    move_to_cluster(members[k], m, new_cdm, slices[k], totals[k]);
+                }
+            }
+        } else {
+            for (int k = 0; k < members.size(); k++) {
+                if (existing_entry(_c.find(members[k])->second, m) == cj) {
+                    move_to_cluster(members[k], m, ci, slices[k], totals[k]);
+                }
+            }
         }
     }
 }
 
+void SoftCrossCatMM::resample_posterior_c_view_task(void* context, unsigned m) {
+    ((SoftCrossCatMM*)context)->resample_posterior_c_view(m);
+}
+
 void SoftCrossCatMM::resample_posterior_z_for(unsigned d) {
     // Leftover from CCMM: might still be relevant?
     // XXX: ratios of Dirichlet Processes won't really work; need to think
@@ -367,6 +550,9 @@ void SoftCrossCatMM::resample_posterior_z_for(unsigned d) {
 
         _cluster[old_zdn][old_cdm].remove_no_ndsum(w,d);
         _cluster_marginal[old_zdn].remove_no_ndsum(w,d);
+        if (_cluster_marginal[old_zdn].nd[d] == 0) {  // last word in this view
+            _cluster[old_zdn][old_cdm].nonzero_ndsum -= 1;
+        }
         
         vector<double> lp_z_dn;
         for (int m = 0; m < FLAGS_M; m++) {
@@ -396,6 +582,9 @@ void SoftCrossCatMM::resample_posterior_z_for(unsigned d) {
 
         _cluster[new_zdn][new_cdm].add_no_ndsum(w,d);
         _cluster_marginal[new_zdn].add_no_ndsum(w,d);
+        if (_cluster_marginal[new_zdn].nd[d] == 1) {  // first word in this view
+            _cluster[new_zdn][new_cdm].nonzero_ndsum += 1;
+        }
 
         if (new_zdn == old_zdn) {
             _m_failed += 1;
@@ -514,49 +703,36 @@ void SoftCrossCatMM::resample_posterior() {
     CHECK_GT(_lD, 0);
     CHECK_GT(_c.size(), 0);
 
-    _temp_log_lik = 0;
-
     // Resample the cluster indicators
-    _c_proposed = _c_failed = 0;
+    reset_view_statistics();
     _m_proposed = _m_failed = 0;
-    for (int d = 0; d < _D.size(); d++) {
-        if (FLAGS_M > 1) {
+    if (FLAGS_threads > 1 && FLAGS_M > 1) {
+        // Moving words between views couples them, so do all the view moves
+        // first; given those, the views are independent and each one's
+        // clusters are sampled on its own thread with its own random stream.
+        for (int d = 0; d < _D.size(); d++) {
             resample_posterior_z_for(d);
         }
-        // LOG(INFO) <<  "  resampling document " <<  d;
-        // For each clustering (view), resample this document's cluster indicator
-        resample_posterior_c_for(d);
-    }
-
-    // Compute the number of documents in this cluster with actual
-    // features in the game
-    map<unsigned, map<unsigned, unsigned> > nonzero_docs;
-    unsigned non_zero_docs = 0;
-    for (DocumentMap::iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
-        unsigned d = d_itr->first;  // = document number
-
-        map<unsigned, map<unsigned, unsigned> > things_im_in;
-        for (int n = 0; n < _D[d].size(); n++) {
-            unsigned w = _D[d][n];
-            things_im_in[_z[d][n]][_c[d][_z[d][n]]] += 1;
+        if (_view_random.empty()) {
+            for (int m = 0; m < FLAGS_M; m++) {
+                _view_random.push_back(new_thread_random(FLAGS_random_seed + m + 1));
+            }
         }
-
-        for (map<unsigned, map<unsigned, unsigned> >::iterator itr = things_im_in.begin();
-                itr != things_im_in.end();
-                itr++) {
-            unsigned m = itr->first;
-            for (map<unsigned,unsigned>::iterator itr2 = itr->second.begin();
-                    itr2 != itr->second.end();
-                    itr2++) {
-                unsigned c = itr2->first;
-                unsigned count = itr2->second;
-
-                if (count > 0) {
-                    nonzero_docs[m][c] += 1;
-                }
+        run_parallel_tasks(FLAGS_M, resample_posterior_c_view_task, this, _view_random);
+    } else {
+        for (int d = 0; d < _D.size(); d++) {
+            if (FLAGS_M > 1) {
+                resample_posterior_z_for(d);
             }
+            // LOG(INFO) <<  "  resampling document " <<  d;
+            // For each clustering (view), resample this document's cluster indicator
+            resample_posterior_c_for(d);
+        }
+        for (int m = 0; m < FLAGS_M; m++) {
+            resample_split_merge_view(m);
         }
     }
+    collect_view_statistics();
 
     // Write the current cluster sizes to the console
     for (multiple_clustering::iterator c_itr = _cluster.begin();
@@ -575,7 +751,7 @@ void SoftCrossCatMM::resample_posterior() {
 
             // LOG(INFO) << "  C[" << l << "] (d " << itr->second.ndsum << ") " 
             //           << " " << show_chopped_sorted_nw(itr->second.nw);
-            LOG(INFO) << "  C[" << l << "] (d " << nonzero_docs[m][l] << "/" << itr->second.ndsum << " nw " << itr->second.nwsum << ") " 
+            LOG(INFO) << "  C[" << l << "] (d " << itr->second.nonzero_ndsum << "/" << itr->second.ndsum << " nw " << itr->second.nwsum << ") " 
                       << " " << show_chopped_sorted_nw(itr->second.nw);
 
             test_sum += _cluster[m][l].ndsum;
@@ -588,7 +764,8 @@ void SoftCrossCatMM::resample_posterior() {
     LOG(INFO) << "||| cluster moves " << _c_proposed-_c_failed << " / " << _c_proposed << " " 
         << StringPrintf("(%.3f%%)", 100 - _c_failed / (double)_c_proposed*100)
         << " ||| view moves " << _m_proposed-_m_failed << " / " << _m_proposed << " " 
-        << StringPrintf("(%.3f%%)", 100 - _m_failed / (double)_m_proposed*100);
+        << StringPrintf("(%.3f%%)", 100 - _m_failed / (double)_m_proposed*100)
+        << (FLAGS_split_merge_rate > 0 ? " ||| split-merge " + _split_merge.summary() : "");
 }
 
 // Write out all the data in an intermediate format
@@ -682,20 +859,27 @@ bool SoftCrossCatMM::restore_data_from_file(string filename, bool seed) {
                 LOG(INFO) << "read correctly, resuming from iter=" << _iter << " ll= " << _best_ll;
                 finished = true;
 
-                // Add the documents into the clustering
+                // Add the documents into the clustering. The file only gives
+                // a document's clusters in the views its words are in, so the
+                // rest start out in cluster 0; every (d, m) has to be filled
+                // in before sampling, since the per-view sweeps share the
+                // per-document maps and must not insert into them. As in the
+                // clean initialization, documents count towards ndsum in
+                // every view.
                 for (DocumentMap::iterator d_itr = _D.begin(); d_itr != _D.end(); d_itr++) {
                     unsigned d = d_itr->first;  // = document number
+                    cluster_map& cd = _c[d];
+                    for (int n = 0; n < _D[d].size(); n++) {
+                        CHECK(_z[d].find(n) != _z[d].end()) << "no view for word " << n << " of document " << d;
+                    }
                     for (int m = 0; m < FLAGS_M; m++) {
-                        for (int n = 0; n < _D[d].size(); n++) {
-                            // XXX: dont' increment doc counts for every cluster; this will probably break stuff
-                            if (_z[d][n] == m) {
-                                CHECK_GE(_cluster[m][_c[d][m]].ndsum, 0);
-                                CHECK_GE(_cluster_marginal[m].ndsum, 0);
-                                _cluster[m][_c[d][m]].ndsum += 1; // Can't use ADD b/c we need to maintain ndsum over all the views
-                                _cluster_marginal[m].ndsum += 1; // Can't use ADD b/c we need to maintain ndsum over all the views
-                                break;
-                            }
+                        if (cd.find(m) == cd.end()) {
+                            cd[m] = 0;
                         }
+                        CHECK_GE(_cluster[m][cd[m]].ndsum, 0);
+                        CHECK_GE(_cluster_marginal[m].ndsum, 0);
+                        _cluster[m][cd[m]].ndsum += 1; // Can't use ADD b/c we need to maintain ndsum over all the views
+                        _cluster_marginal[m].ndsum += 1; // Can't use ADD b/c we need to maintain ndsum over all the views
                     }
                 }
                 break;
@@ -734,6 +918,9 @@ bool SoftCrossCatMM::restore_data_from_file(string filename, bool seed) {
             unsigned w = _D[d][n];
             _cluster[zdn][cdm].add_no_ndsum(w, d);
             _cluster_marginal[zdn].add_no_ndsum(w, d);
+            if (_cluster_marginal[zdn].nd[d] == 1) {  // first word in this view
+                _cluster[zdn][cdm].nonzero_ndsum += 1;
+            }
         }
         VLOG(1) << "done";
     }
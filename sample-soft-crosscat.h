@@ -21,6 +21,8 @@
 #include<map>
 
 #include "gibbs-base.h"
+#include "mixture-scorer.h"
+#include "split-merge.h"
 
 // Two main implementations:
 //   (1) normal: treat the topic model part for a document as the set of
@@ -57,6 +59,7 @@ DECLARE_string(cc_fixed_topic_seed);
 class SoftCrossCatMM : public GibbsSampler {
     public:
         SoftCrossCatMM() { }
+        ~SoftCrossCatMM();
 
         // Allocate all the documents at once (called for non-streaming)
         void batch_allocation();
@@ -74,11 +77,23 @@ class SoftCrossCatMM : public GibbsSampler {
     protected:
         void resample_posterior();
         void resample_posterior_c_for(unsigned d);
+        void resample_posterior_c_for(unsigned d, unsigned m);
+        void resample_posterior_c_view(unsigned m);
+        static void resample_posterior_c_view_task(void* context, unsigned m);
+        void resample_split_merge_view(unsigned m);
+        unsigned view_slice(unsigned d, unsigned m, feature_counts* slice);
+        void move_to_cluster(unsigned d, unsigned m, unsigned new_cdm,
+                const feature_counts& slice, unsigned total);
         void resample_posterior_z_for(unsigned d);
 
 
         string current_state();
 
+        // Clears the per-view move counts and likelihoods, and sums them into
+        // _c_proposed, _c_failed, _split_merge and _temp_log_lik
+        void reset_view_statistics();
+        void collect_view_statistics();
+
     protected:
         // Maps documents to clusters
         multiple_cluster_map _c; // Map [d][m] -> cluster_id
@@ -109,6 +124,23 @@ class SoftCrossCatMM : public GibbsSampler {
         bool is_fixed_topics;
 
         double _temp_log_lik;
+
+        // Cluster moves and sampled likelihood broken down by view, so that
+        // views can be resampled concurrently
+        vector<unsigned> _view_c_proposed;
+        vector<unsigned> _view_c_failed;
+        vector<double> _view_log_lik;
+        vector<SplitMergeStats> _view_split_merge;
+
+        // Split-merge proposals and acceptances over all the views
+        SplitMergeStats _split_merge;
+
+        // Each view's random stream when --threads > 1
+        vector<ThreadRandom*> _view_random;
+
+        // Each view's document scorer and its scratch space for the scores
+        vector<MixtureScorer> _view_scorer;
+        vector< vector<double> > _view_scores;
 };
 
 #endif  // SAMPLE_SOFT_CROSSCAT_MM_H_
@@ -0,0 +1,237 @@
+/*
+   Copyright 2010 Joseph Reisinger
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <math.h>
+#include <stdlib.h>
+
+#include "gibbs-base.h"
+#include "split-merge.h"
+#include "strutil.h"
+
+// Number of split-merge proposals per view per Gibbs sweep, as a fraction of
+// the number of documents (0 turns them off)
+DEFINE_double(split_merge_rate,
+              0.0,
+              "Split-merge proposals per view per sweep, as a fraction of the documents.");
+
+// Comma-separated list of the views to make split-merge proposals in (empty
+// means all of them)
+DEFINE_string(split_merge_views,
+              "",
+              "Views to make split-merge proposals in (default all).");
+
+// Number of intermediate restricted Gibbs scans used to build the launch state
+DEFINE_int32(split_merge_scans,
+             5,
+             "Number of restricted Gibbs scans for the split-merge launch state.");
+
+bool split_merge_enabled_for(unsigned m) {
+    if (FLAGS_split_merge_rate <= 0) {
+        return false;
+    }
+    if (FLAGS_split_merge_views.empty()) {
+        return true;
+    }
+    vector<string> views;
+    SplitStringUsing(FLAGS_split_merge_views, ",", &views);
+    for (int i = 0; i < views.size(); i++) {
+        if (atoi(views[i].c_str()) == m) {
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned split_merge_proposals(unsigned D) {
+    double expected = FLAGS_split_merge_rate * D;
+    unsigned proposals = (unsigned)expected;
+    if (sample_uniform() < expected - proposals) {
+        proposals += 1;
+    }
+    return proposals;
+}
+
+void SplitMergeStats::add(const SplitMergeStats& other) {
+    split_proposed += other.split_proposed;
+    split_accepted += other.split_accepted;
+    merge_proposed += other.merge_proposed;
+    merge_accepted += other.merge_accepted;
+}
+
+string SplitMergeStats::summary() const {
+    return StringPrintf("%d / %d splits %d / %d merges",
+            split_accepted, split_proposed, merge_accepted, merge_proposed);
+}
+
+void ClusterMembers::gather(unsigned i, unsigned ci, unsigned j, unsigned cj,
+        vector<unsigned>* members) const {
+    members->clear();
+    members->push_back(i);
+    members->push_back(j);
+    for (int c = 0; c < ((ci == cj) ? 1 : 2); c++) {
+        const vector<unsigned>& docs = _members.find(c == 0 ? ci : cj)->second;
+        for (int k = 0; k < docs.size(); k++) {
+            if (docs[k] != i && docs[k] != j) {
+                members->push_back(docs[k]);
+            }
+        }
+    }
+}
+
+void ClusterMembers::apply(const vector<unsigned>& members,
+        const vector<unsigned>& side, unsigned ci, unsigned cj,
+        unsigned new_cluster) {
+    if (ci == cj) {
+        vector<unsigned>& stay = _members[ci];
+        vector<unsigned>& leave = _members[new_cluster];
+        stay.clear();
+        for (int k = 0; k < members.size(); k++) {
+            (side[k] == 0 ? stay : leave).push_back(members[k]);
+        }
+    } else {
+        _members[ci] = members;
+        _members.erase(cj);
+    }
+}
+
+// Moves a document in or out of one of the proposal's clusters
+static void add_to(CRP* cluster, const feature_counts& doc, unsigned total) {
+    for (int i = 0; i < doc.size(); i++) {
+        cluster->nw[doc[i].first] += doc[i].second;
+    }
+    cluster->nwsum += total;
+    cluster->ndsum += 1;
+}
+
+static void remove_from(CRP* cluster, const feature_counts& doc, unsigned total) {
+    for (int i = 0; i < doc.size(); i++) {
+        cluster->nw[doc[i].first] -= doc[i].second;
+    }
+    cluster->nwsum -= total;
+    cluster->ndsum -= 1;
+}
+
+// Marginal likelihood of all the data in a cluster
+static double cluster_log_likelihood(const CRP& cluster,
+        const vector<double>& eta, double eta_sum) {
+    double log_lik = -log_gamma_ratio(eta_sum, cluster.nwsum);
+    for (WordToCountMap::const_iterator itr = cluster.nw.begin();
+            itr != cluster.nw.end();
+            itr++) {
+        log_lik += log_gamma_ratio(eta[itr->first], itr->second);
+    }
+    return log_lik;
+}
+
+// One restricted Gibbs scan over the non-anchor documents, only allowing them
+// to move between the two clusters in split. If target is given, the scan is
+// forced to end up there instead of sampling. Returns the log probability of
+// the transitions taken.
+static double restricted_gibbs_scan(const vector<const feature_counts*>& docs,
+        const vector<unsigned>& totals, const vector<double>& eta,
+        double eta_sum, MixtureScorer* scorer, clustering* split,
+        vector<unsigned>* state, const vector<unsigned>* target) {
+    vector<double> scores;
+    double log_q = 0;
+    for (int k = 2; k < docs.size(); k++) {
+        remove_from(&(*split)[state->at(k)], *docs[k], totals[k]);
+
+        scorer->load(*split);
+        scorer->score(*docs[k], totals[k], eta, eta_sum, &scores);
+        double lp[2];
+        for (int c = 0; c < scorer->size(); c++) {
+            lp[scorer->id(c)] = log(scorer->ndsum(c)) + scores[c];
+        }
+        double norm = max(lp[0], lp[1]);
+        norm += log(exp(lp[0] - norm) + exp(lp[1] - norm));
+
+        unsigned next;
+        if (target) {
+            next = target->at(k);
+        } else {
+            next = (log(sample_uniform()) < lp[1] - norm) ? 1 : 0;
+        }
+        log_q += lp[next] - norm;
+
+        state->at(k) = next;
+        add_to(&(*split)[next], *docs[k], totals[k]);
+    }
+    return log_q;
+}
+
+bool split_merge_move(const vector<const feature_counts*>& docs,
+        const vector<unsigned>& totals, double alpha,
+        const vector<double>& eta, double eta_sum,
+        MixtureScorer* scorer, vector<unsigned>* side,
+        SplitMergeStats* stats) {
+    CHECK_GE(docs.size(), 2);
+    CHECK_EQ(docs.size(), side->size());
+    bool is_split = (side->at(1) == 0);
+
+    // Launch state: the anchors go in separate clusters and everything else is
+    // split up at random, then shuffled around with a few restricted scans
+    clustering split;
+    split.set_empty_key(kEmptyUnsignedKey);
+    split[0] = CRP();
+    split[1] = CRP();
+    vector<unsigned> launch(docs.size());
+    for (int k = 0; k < docs.size(); k++) {
+        launch[k] = (k < 2) ? k : sample_integer(2);
+        add_to(&split[launch[k]], *docs[k], totals[k]);
+    }
+    for (int t = 0; t < FLAGS_split_merge_scans; t++) {
+        restricted_gibbs_scan(docs, totals, eta, eta_sum, scorer, &split,
+                &launch, NULL);
+    }
+
+    // Likelihood of the data when everything is in a single cluster
+    CRP merged;
+    for (int k = 0; k < docs.size(); k++) {
+        add_to(&merged, *docs[k], totals[k]);
+    }
+    double log_merged = cluster_log_likelihood(merged, eta, eta_sum)
+        + gammaln(docs.size());
+
+    // One last scan from the launch state gives the proposed split, or for a
+    // merge, the probability that the reverse split would have recovered the
+    // current clusters
+    double log_q = restricted_gibbs_scan(docs, totals, eta, eta_sum, scorer,
+            &split, &launch, is_split ? NULL : side);
+    double log_split = log(alpha)
+        + cluster_log_likelihood(split[0], eta, eta_sum) + gammaln(split[0].ndsum)
+        + cluster_log_likelihood(split[1], eta, eta_sum) + gammaln(split[1].ndsum);
+
+    double log_ratio;
+    if (is_split) {
+        log_ratio = log_split - log_merged - log_q;
+        stats->split_proposed += 1;
+    } else {
+        log_ratio = log_merged - log_split + log_q;
+        stats->merge_proposed += 1;
+    }
+
+    if (log(sample_uniform()) >= log_ratio) {
+        return false;
+    }
+
+    if (is_split) {
+        *side = launch;
+        stats->split_accepted += 1;
+    } else {
+        side->assign(docs.size(), 0);
+        stats->merge_accepted += 1;
+    }
+    return true;
+}
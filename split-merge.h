@@ -0,0 +1,104 @@
+/*
+   Copyright 2010 Joseph Reisinger
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Restricted Gibbs split-merge moves (Jain & Neal, 2004) for the DP mixtures
+// of Dirichlet-multinomials used by the mixture model samplers. Single-site
+// Gibbs has a hard time pulling apart two clusters that got merged early on;
+// these moves split or merge whole clusters in one MH step.
+
+#ifndef SPLIT_MERGE_H_
+#define SPLIT_MERGE_H_
+
+#include <vector>
+
+#include "gibbs-base.h"
+#include "mixture-scorer.h"
+
+// Number of split-merge proposals per view per Gibbs sweep, as a fraction of
+// the number of documents (0 turns them off)
+DECLARE_double(split_merge_rate);
+
+// Comma-separated list of the views to make split-merge proposals in (empty
+// means all of them)
+DECLARE_string(split_merge_views);
+
+// Number of intermediate restricted Gibbs scans used to build the launch state
+DECLARE_int32(split_merge_scans);
+
+// Should split-merge proposals be made in view m?
+bool split_merge_enabled_for(unsigned m);
+
+// Number of split-merge proposals to make in one sweep over D documents
+unsigned split_merge_proposals(unsigned D);
+
+// Proposal and acceptance counts, kept separately for splits and merges
+struct SplitMergeStats {
+    SplitMergeStats() : split_proposed(0), split_accepted(0),
+                        merge_proposed(0), merge_accepted(0) { }
+
+    unsigned split_proposed;
+    unsigned split_accepted;
+    unsigned merge_proposed;
+    unsigned merge_accepted;
+
+    void add(const SplitMergeStats& other);
+    string summary() const;
+};
+
+// The documents in each cluster of one view. Built once per sweep and kept up
+// to date as split-merge moves are accepted, so gathering up a proposal's
+// documents doesn't have to scan the whole collection.
+class ClusterMembers {
+    public:
+        ClusterMembers() {
+            _members.set_empty_key(kEmptyUnsignedKey);
+            _members.set_deleted_key(kDeletedUnsignedKey);
+        }
+
+        void clear() { _members.clear(); }
+        void add(unsigned cluster, unsigned d) { _members[cluster].push_back(d); }
+
+        // Fills members with the anchors i and j (in clusters ci and cj)
+        // followed by the rest of the documents in their clusters
+        void gather(unsigned i, unsigned ci, unsigned j, unsigned cj,
+                vector<unsigned>* members) const;
+
+        // Records an accepted split_merge_move over members: after a split
+        // the documents with side 1 go to new_cluster, and after a merge
+        // everything ends up in ci
+        void apply(const vector<unsigned>& members, const vector<unsigned>& side,
+                unsigned ci, unsigned cj, unsigned new_cluster);
+
+    private:
+        google::dense_hash_map<unsigned, vector<unsigned> > _members;
+};
+
+// Makes one split-merge proposal. docs[0] and docs[1] are the two randomly
+// chosen anchor documents and docs[2..] are the other documents in their
+// clusters, with totals holding each one's number of tokens. side[k] is 0 or
+// 1 for whether document k is currently in docs[0]'s or docs[1]'s cluster
+// (all 0 if the anchors share a cluster, in which case a split is proposed,
+// and a merge otherwise).
+//
+// Returns whether the move was accepted, in which case side holds the new
+// assignment: after a split the documents with side 1 make up the new
+// cluster, and after a merge they are all 0.
+bool split_merge_move(const vector<const feature_counts*>& docs,
+        const vector<unsigned>& totals, double alpha,
+        const vector<double>& eta, double eta_sum,
+        MixtureScorer* scorer, vector<unsigned>* side,
+        SplitMergeStats* stats);
+
+#endif  // SPLIT_MERGE_H_